@@ -22,22 +22,62 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <errno.h>
 #include <pthread.h>
 #include <libgen.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <malloc.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <dirent.h>
+
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 #include "fuse.h"
 #include <net-snmp/net-snmp-config.h>
 #include <net-snmp/net-snmp-includes.h>
 
-#define MAX_RELAYS 16
+#include "dkrfs.h"
+#include "dkrfs_ioctl.h"
 
 static const char* _version = "0.1.1";
 
 static time_t _start_time;
 
-typedef enum { relay_off, relay_on } relay_state;
-
 enum {
     KEY_NUM_RELAYS,
     KEY_COMMUNITY,
+    KEY_POLL,
+    KEY_SHARED,
+    KEY_LOCKDIR,
+    KEY_AGENT,
+    KEY_BACKEND,
+    KEY_EXPORT,
+    KEY_BENCH,
+    KEY_RECORD,
+    KEY_TRACE,
+    KEY_SOAK,
+    KEY_MICROBENCH,
+    KEY_AUDIT,
+    KEY_HISTORY,
+    KEY_HISTORY_KEEP,
+    KEY_IDLE,
+    KEY_FLEET,
+    KEY_FLEET_DEADLINE,
+    KEY_SOAK_BUDGET,
+    KEY_SOAK_ALLOCS,
+    KEY_PREFETCH,
+    KEY_PERF,
+    KEY_QUEUE,
+    KEY_OVERLOAD,
+    KEY_OVERLOAD_TIMEOUT,
+    KEY_LIMIT,
+    KEY_VIRTUAL_CLOCK,
     KEY_HELP,
     KEY_VERSION
 };
@@ -47,6 +87,32 @@ static struct fuse_opt options[] = {
     FUSE_OPT_KEY("relays=%u",      KEY_NUM_RELAYS),
     FUSE_OPT_KEY("-c %s",          KEY_COMMUNITY),
     FUSE_OPT_KEY("community=%s",   KEY_COMMUNITY),
+    FUSE_OPT_KEY("poll=%u",        KEY_POLL),
+    FUSE_OPT_KEY("shared",         KEY_SHARED),
+    FUSE_OPT_KEY("lockdir=%s",     KEY_LOCKDIR),
+    FUSE_OPT_KEY("agent=%s",       KEY_AGENT),
+    FUSE_OPT_KEY("backend=%s",     KEY_BACKEND),
+    FUSE_OPT_KEY("export=%s",      KEY_EXPORT),
+    FUSE_OPT_KEY("bench=%u",       KEY_BENCH),
+    FUSE_OPT_KEY("record=%s",      KEY_RECORD),
+    FUSE_OPT_KEY("trace=%s",       KEY_TRACE),
+    FUSE_OPT_KEY("soak=%u",        KEY_SOAK),
+    FUSE_OPT_KEY("microbench=%u",  KEY_MICROBENCH),
+    FUSE_OPT_KEY("audit=%s",       KEY_AUDIT),
+    FUSE_OPT_KEY("history=%s",     KEY_HISTORY),
+    FUSE_OPT_KEY("history_keep=%u", KEY_HISTORY_KEEP),
+    FUSE_OPT_KEY("idle=%u",        KEY_IDLE),
+    FUSE_OPT_KEY("fleet=%s",       KEY_FLEET),
+    FUSE_OPT_KEY("fleet_deadline=%u", KEY_FLEET_DEADLINE),
+    FUSE_OPT_KEY("soakbudget=%u",  KEY_SOAK_BUDGET),
+    FUSE_OPT_KEY("soakallocs=%u",  KEY_SOAK_ALLOCS),
+    FUSE_OPT_KEY("prefetch",       KEY_PREFETCH),
+    FUSE_OPT_KEY("perf",           KEY_PERF),
+    FUSE_OPT_KEY("queue=%u",       KEY_QUEUE),
+    FUSE_OPT_KEY("overload=%s",    KEY_OVERLOAD),
+    FUSE_OPT_KEY("overload_timeout=%u", KEY_OVERLOAD_TIMEOUT),
+    FUSE_OPT_KEY("limit=%s",       KEY_LIMIT),
+    FUSE_OPT_KEY("clock=virtual",  KEY_VIRTUAL_CLOCK),
     FUSE_OPT_KEY("-V",             KEY_VERSION),
     FUSE_OPT_KEY("--version",      KEY_VERSION),
     FUSE_OPT_KEY("-h",             KEY_HELP),
@@ -57,14 +123,243 @@ static struct fuse_opt options[] = {
 static unsigned int _num_relays = 16;
 static char * _peername = NULL;
 static char * _community = NULL;
+static unsigned int _poll_ms = 0;
+static int _shared = 0;
+static char * _lockdir = NULL;
+static char * _agent_addr = NULL;
+static char * _export_addr = NULL;
+static unsigned int _bench_count = 0;
+static unsigned int _soak_count = 0;
+static unsigned int _soak_budget = 64;
+static unsigned int _soak_alloc_budget = 10;
+static unsigned int _microbench_count = 0;
+static int _prefetch = 0;
+static int _mounted = 0;
+static int _perf = 0;
+
+/* What to do with a request when the device already has queue_max
+ * requests waiting for it or in flight */
+typedef enum { overload_busy, overload_stale, overload_block } overload_policy;
+
+static const char * _overload_names[] = { "busy", "stale", "block" };
+
+static unsigned int _queue_max = 0;     // 0 for no limit
+static overload_policy _overload = overload_busy;
+static unsigned int _overload_timeout_ms = 1000;
+
+#define LIMIT_MAX       16      // most requests we'd ever have at a device
+
+/* How many requests may be at the device at once: a fixed number, or
+ * with -o limit=adaptive a window that grows by one per round trip while
+ * the device keeps up and shrinks when its latency climbs or it stops
+ * answering.  0 for no limit. */
+static unsigned int _limit = 0;
+static int _limit_adaptive = 0;
+
+static char * _record_path = NULL;
+static FILE * _record_file = NULL;
+static char * _trace_path = NULL;
+static char * _audit_path = NULL;
+static char * _history_dir = NULL;
+static char * _fleet_path = NULL;
+static unsigned int _fleet_deadline_ms = 1000;
+static unsigned int _history_keep_days = 0;    // 0 to keep everything
+static unsigned int _idle_s = 0;                // 0 to keep device connections open
+static FILE * _trace_file = NULL;
+static uint64_t _trace_start;
 
-static struct snmp_session * _snmp_session;
+
+#define SNAPSHOT_MAGIC 0x646b7268  // changes with the layout below
+
+/* Relay states as last seen by the poller.  Lives in a shared memory
+ * segment when several mounts of the same device are told to share it,
+ * otherwise in _local_snapshot.  The mutex is robust so a leader dying
+ * while holding it doesn't wedge the followers. */
+struct snapshot {
+    uint32_t magic;
+    pthread_mutex_t mutex;
+    pid_t leader;
+    unsigned int poll_ms;
+    uint32_t bits;
+    uint32_t known;         // relays whose state we've ever seen
+    uint32_t polled;        // relays covered by the last poll
+    uint64_t updated;       // CLOCK_MONOTONIC ms of the last poll
+    struct timespec changed[MAX_RELAYS];    // when we saw each relay change, if we have
+    uint64_t issued;                // tickets handed out, see _snapshot_ticket()
+    uint64_t applied[MAX_RELAYS];   // ticket of the reply each relay's state came from
+    uint64_t generation;            // bumped whenever any relay changes
+    uint64_t version[MAX_RELAYS];   // generation at which each relay last changed
+};
+
+static struct snapshot _local_snapshot;
+static struct snapshot * _snapshot = &_local_snapshot;
+static int _lock_fd = -1;
+static int _leader = 0;
+
+static pthread_t _poll_thread;
+static int _polling = 0;
+static pthread_mutex_t _poll_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _poll_cond;
 
 static struct {
     oid id[MAX_OID_LEN];
     size_t len;
 } _oids[MAX_RELAYS];
 
+#define RTT_BUCKETS 32      // bucket n holds round trips under 2^(n+1) us
+
+/* Counters behind /.stats, updated without locks */
+static struct {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t read_errors;
+    uint64_t write_errors;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t requests;
+    uint64_t request_errors;
+    uint64_t retries;
+    uint64_t prefetches;
+    uint64_t board_prefetches;
+    uint64_t prefetch_hits;
+    uint64_t rejected;
+    uint64_t stale_served;
+    uint64_t blocked;
+    uint64_t limit_decreases;
+    uint64_t stale_replies;
+    uint64_t audit_entries;
+    uint64_t audit_commits;
+    uint64_t sessions_opened;
+    uint64_t sessions_reaped;
+    uint64_t fleet_sweeps;
+    uint64_t fleet_coalesced;
+    uint64_t rtt[RTT_BUCKETS];
+    uint32_t inflight;
+    uint32_t inflight_max;
+} _stats;
+
+#define STAT_ADD(field, n) __atomic_add_fetch(&_stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_INC(field) STAT_ADD(field, 1)
+
+/* With -o perf the CPU's counters are read around each relay read and
+ * write and each SNMP message built or taken apart, and the differences
+ * added up by operation for .stats.  Each thread opens its own counters
+ * the first time it needs them and closes them when it exits; any the
+ * CPU or kernel won't give are left out and count as nothing. */
+enum { PERF_READ, PERF_WRITE, PERF_ENCODE, PERF_DECODE, PERF_OPS };
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_CACHE_MISSES, PERF_CONTEXT_SWITCHES, PERF_COUNTERS };
+
+static const char * _perf_op_names[PERF_OPS] = { "read", "write", "encode", "decode" };
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} _perf_events[PERF_COUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+static struct {
+    uint64_t count;
+    uint64_t total[PERF_COUNTERS];
+} _perf_totals[PERF_OPS];
+
+static pthread_key_t _perf_key;
+
+static __thread struct perf_thread {
+    int state;                  // 0 not opened yet, 1 counting, -1 nothing to count
+    int leader;
+    int fd[PERF_COUNTERS];
+    int slot[PERF_COUNTERS];    // where each counter comes in a read of the group, -1 if not open
+} _perf_thread;
+
+struct perf_sample {
+    int on;
+    uint64_t v[PERF_COUNTERS];
+};
+
+static void _perf_thread_close(void * arg)
+{
+    struct perf_thread * t = arg;
+    int i;
+
+    for (i = 0; i < PERF_COUNTERS; i++)
+        if (t->slot[i] >= 0)
+            close(t->fd[i]);
+    t->state = 0;
+}
+
+static int _perf_thread_open(void)
+{
+    struct perf_thread * t = &_perf_thread;
+    struct perf_event_attr attr;
+    int i, n = 0;
+
+    t->leader = -1;
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = _perf_events[i].type;
+        attr.config = _perf_events[i].config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        t->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, t->leader, PERF_FLAG_FD_CLOEXEC);
+        if (t->fd[i] < 0 && attr.type == PERF_TYPE_HARDWARE) {
+            // perf_event_paranoid may only let us count user space
+            attr.exclude_kernel = attr.exclude_hv = 1;
+            t->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, t->leader, PERF_FLAG_FD_CLOEXEC);
+        }
+        t->slot[i] = t->fd[i] < 0 ? -1 : n++;
+        if (t->leader < 0)
+            t->leader = t->fd[i];
+    }
+    t->state = n ? 1 : -1;
+    if (n)
+        pthread_setspecific(_perf_key, t);
+    return n;
+}
+
+static void _perf_read(struct perf_sample * s)
+{
+    struct perf_thread * t = &_perf_thread;
+    uint64_t buf[1 + PERF_COUNTERS];
+    int i;
+
+    s->on = read(t->leader, buf, sizeof(buf)) > 0;
+    for (i = 0; i < PERF_COUNTERS; i++)
+        s->v[i] = t->slot[i] >= 0 ? buf[1 + t->slot[i]] : 0;
+}
+
+static void _perf_begin(struct perf_sample * s)
+{
+    s->on = 0;
+    if (!_perf || _perf_thread.state < 0 || (!_perf_thread.state && !_perf_thread_open()))
+        return;
+    _perf_read(s);
+}
+
+static void _perf_end(int op, const struct perf_sample * s)
+{
+    struct perf_sample e;
+    int i;
+
+    if (!s->on)
+        return;
+    _perf_read(&e);
+    if (!e.on)
+        return;
+    __atomic_add_fetch(&_perf_totals[op].count, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < PERF_COUNTERS; i++)
+        __atomic_add_fetch(&_perf_totals[op].total[i], e.v[i] - s->v[i], __ATOMIC_RELAXED);
+}
+
+static void _perf_init(void)
+{
+    if (_perf)
+        pthread_key_create(&_perf_key, _perf_thread_close);
+}
+
 static int _relay_from_path(const char * path)
 {
     if (path[0] == '/' && path[1] == 'r' && path[2] >= '1' && path[2] <= '9') {
@@ -75,100 +370,2956 @@ static int _relay_from_path(const char * path)
     }
     return -1;
 }
+
+static int _relay_from_oid(const oid * name, size_t len)
+{
+    unsigned int i;
+    for (i = 0; i < _num_relays; i++)
+        if (!snmp_oid_compare(name, len, _oids[i].id, _oids[i].len))
+            return i;
+    return -1;
+}
         
-static void * _init(struct fuse_conn_info * conn)
+/* With -o clock=virtual time stands still until something sleeps, so a
+ * bench or soak run against a replayed device takes no longer than the
+ * work itself and comes out the same every time. */
+static int _virtual_clock = 0;
+static uint64_t _virtual_us = 0;
+
+/* Monotonic time even under the virtual clock, for waiting on sockets */
+static uint64_t _now_monotonic(void)
 {
-    return NULL;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-static int _snmp_synch(struct snmp_pdu * pdu, relay_state * s) {
-    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t _now_us(void)
+{
+    if (_virtual_clock)
+        return __atomic_load_n(&_virtual_us, __ATOMIC_RELAXED);
+    return _now_monotonic();
+}
 
-    int ret = 0;
-    struct snmp_pdu * response = NULL;
+uint64_t dkrfs_now_us(void)
+{
+    return _now_us();
+}
 
-    pthread_mutex_lock( &mutex );
-    int status = snmp_synch_response(_snmp_session, pdu, &response);
-    pthread_mutex_unlock( &mutex );
+void dkrfs_sleep_us(uint64_t us)
+{
+    struct timespec ts;
 
-    if (status == STAT_SUCCESS && response->errstat == SNMP_ERR_NOERROR) {
-        ret = 1;
-        if (s)
-            *s = *response->variables->val.integer == 0 ? relay_off : relay_on;
+    if (_virtual_clock) {
+        __atomic_add_fetch(&_virtual_us, us, __ATOMIC_RELAXED);
+        return;
     }
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = us % 1000000 * 1000;
+    nanosleep(&ts, NULL);
+}
 
-    if (response)
-        snmp_free_pdu(response);
+/* Wall clock time, which moves with the virtual clock from the mount
+ * time when that's in use. */
+static void _now_real(struct timespec * ts)
+{
+    if (_virtual_clock) {
+        uint64_t us = _now_us();
+        ts->tv_sec = _start_time + us / 1000000;
+        ts->tv_nsec = us % 1000000 * 1000;
+    } else
+        clock_gettime(CLOCK_REALTIME, ts);
+}
 
-    return ret;
+static uint64_t _now_ms(void)
+{
+    return _now_us() / 1000;
 }
 
-static int _set_relay(int relay_num, relay_state s)
+static void _snapshot_lock(void)
 {
-    struct snmp_pdu *pdu = snmp_pdu_create(SNMP_MSG_SET);
-    long v = s == relay_on ? 1 : 0;
-    snmp_pdu_add_variable(pdu, _oids[relay_num].id, _oids[relay_num].len, ASN_INTEGER, &v, 1);
-    return _snmp_synch(pdu, NULL);
+    if (pthread_mutex_lock(&_snapshot->mutex) == EOWNERDEAD)
+        pthread_mutex_consistent(&_snapshot->mutex);
 }
 
-static int _get_relay(int relay_num, relay_state * s)
+static void _snapshot_unlock(void)
 {
-    struct snmp_pdu *pdu = snmp_pdu_create(SNMP_MSG_GET);
-    snmp_add_null_var(pdu, _oids[relay_num].id, _oids[relay_num].len);
-    return _snmp_synch(pdu, s);
+    pthread_mutex_unlock(&_snapshot->mutex);
 }
 
-static int _getattr(const char *path, struct stat *stbuf)
+static void _snapshot_init(struct snapshot * snap, int pshared)
 {
-    memset(stbuf, 0, sizeof(struct stat));
+    pthread_mutexattr_t attr;
 
-    if (!strcmp(path, "/")) {
-        stbuf->st_mode = S_IFDIR | 0775;
-        stbuf->st_nlink = 2;
-        stbuf->st_ctime = _start_time;
-        stbuf->st_mtime = _start_time;
-        stbuf->st_uid = getuid();
-        stbuf->st_gid = getgid();
+    memset(snap, 0, sizeof(*snap));
+    pthread_mutexattr_init(&attr);
+    if (pshared) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    }
+    pthread_mutex_init(&snap->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    snap->magic = SNAPSHOT_MAGIC;
+}
+
+/* Replies are ordered by ticket: a GET takes one when it's sent, a SET
+ * when the device has acknowledged it, and a state is only replaced by
+ * one with a later ticket.  So a slow reply to a GET sent before a SET
+ * can't undo it. */
+static uint64_t _snapshot_ticket(void)
+{
+    return __atomic_add_fetch(&_snapshot->issued, 1, __ATOMIC_RELAXED);
+}
+
+/* The ticket of the GET this thread is waiting on, for backends that
+ * report what they see through dkrfs_observed() */
+static __thread uint64_t _ticket;
+
+/* Every request to the device, from when it asks for a place until it's
+ * answered, oldest first, for .queue.  Entries live on their callers'
+ * stacks, and the list has a lock of its own so that reading .queue
+ * never holds up admission. */
+enum { REQUEST_GET, REQUEST_SET, REQUEST_GET_ALL, REQUEST_SET_MASK };
+
+static const char * _request_types[] = { "get", "set", "get_all", "set_mask" };
+
+struct request {
+    uint64_t queued_us;
+    uint64_t admitted_us;       // given a place at the device
+    uint64_t sent_us;           // 0 until the backend has a connection for it
+    uint32_t mask;              // the relays it's about
+    uint32_t retries;
+    pid_t pid;                  // whose read or write it is, 0 if nobody's
+    int type;
+    struct request * prev, * next;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    struct request * head, * tail;
+} _requests = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+/* The request this thread is making, for backends to count retries on */
+static __thread struct request * _request;
+
+static void _export_changed(uint32_t mask, uint32_t bits);
+static void _history_append(uint32_t bits, uint32_t known);
+
+/* The generation this process last passed on to its export subscribers
+ * and history, which in a shared snapshot may be behind other mounts. */
+static uint64_t _delivered;
+
+/* Pass on whatever has changed in the snapshot since we last did, from
+ * this mount or any other sharing it.  Called with the snapshot locked,
+ * so subscribers and the history see changes in the order they were
+ * made. */
+static void _snapshot_deliver(void)
+{
+    uint32_t changed = 0;
+    int relay;
+
+    if (_snapshot->generation == _delivered)
+        return;
+    // a relay that went and came back in between still changed
+    for (relay = 0; relay < MAX_RELAYS; relay++)
+        if (_snapshot->version[relay] > _delivered)
+            changed |= 1u << relay;
+    _export_changed(changed, _snapshot->bits);
+    _history_append(_snapshot->bits, _snapshot->known);
+    _delivered = _snapshot->generation;
+}
+
+/* Record states for the relays in mask, as of ticket.  Only a poll
+ * refreshes the timestamp; anything else just keeps the bits honest.
+ * Returns every relay's state afterwards, which for those the reply was
+ * too old for is newer than what it said. */
+static uint32_t _snapshot_store(uint32_t mask, uint32_t bits, int polled, uint64_t ticket)
+{
+    uint32_t changed, flipped, stale = 0, m;
+    struct timespec now;
+
+    _now_real(&now);
+
+    _snapshot_lock();
+    for (m = mask; m; m &= m - 1) {
+        int relay = __builtin_ctz(m);
+        if (_snapshot->applied[relay] > ticket)
+            stale |= 1u << relay;
+        else
+            _snapshot->applied[relay] = ticket;
+    }
+    if (polled) {
+        _snapshot->polled = mask;
+        _snapshot->updated = _now_ms();
+        _snapshot->poll_ms = _poll_ms;
+    }
+    mask &= ~stale;
+    changed = ((_snapshot->bits ^ bits) | ~_snapshot->known) & mask;
+    if (changed)
+        _snapshot->generation++;
+    for (m = changed; m; m &= m - 1)
+        _snapshot->version[__builtin_ctz(m)] = _snapshot->generation;
+    flipped = changed & _snapshot->known;
+    while (flipped) {
+        _snapshot->changed[__builtin_ctz(flipped)] = now;
+        flipped &= flipped - 1;
+    }
+    _snapshot->bits = (_snapshot->bits & ~mask) | (bits & mask);
+    _snapshot->known |= mask;
+    bits = _snapshot->bits;
+    _snapshot_deliver();
+    _snapshot_unlock();
+
+    if (stale)
+        STAT_ADD(stale_replies, __builtin_popcount(stale));
+    return bits;
+}
+
+void dkrfs_observed(uint32_t mask, uint32_t bits)
+{
+    _snapshot_store(mask, bits, 0, _ticket ? _ticket : _snapshot_ticket());
+}
+
+/* The last state we saw a relay in, however long ago. */
+static int _snapshot_last(int relay_num, relay_state * s)
+{
+    int ret = 0;
+
+    _snapshot_lock();
+    if (_snapshot->known & (1u << relay_num)) {
+        *s = _snapshot->bits & (1u << relay_num) ? relay_on : relay_off;
+        ret = 1;
+    }
+    _snapshot_unlock();
+
+    return ret;
+}
+
+/* When the relay was last seen to change, or when we were mounted if it
+ * hasn't been. */
+static struct timespec _snapshot_changed(int relay_num)
+{
+    struct timespec ts;
+
+    _snapshot_lock();
+    ts = _snapshot->changed[relay_num];
+    _snapshot_unlock();
+
+    if (!ts.tv_sec) {
+        ts.tv_sec = _start_time;
+        ts.tv_nsec = 0;
+    }
+    return ts;
+}
+
+/* Serve a relay from the snapshot if the poller has it and hasn't
+ * missed more than one interval. */
+static int _snapshot_load(int relay_num, relay_state * s)
+{
+    int ret = 0;
+
+    if (!_poll_ms)
         return 0;
+
+    _snapshot_lock();
+    if ((_snapshot->polled & (1u << relay_num))
+            && _now_ms() - _snapshot->updated <= 2 * _snapshot->poll_ms) {
+        *s = _snapshot->bits & (1u << relay_num) ? relay_on : relay_off;
+        ret = 1;
     }
+    _snapshot_unlock();
 
-    int channel = _relay_from_path(path);
-    if (channel >= 0) {
-        stbuf->st_mode = S_IFREG | 0664;
-        stbuf->st_nlink = 1;
-        stbuf->st_size = 1;
-        stbuf->st_ctime = _start_time;
-        stbuf->st_mtime = time(NULL);   // use current time as we can't assume we were last to switch
-        stbuf->st_uid = getuid();
-        stbuf->st_gid = getgid();
+    return ret;
+}
+
+/* Map the segment shared by every mount of this peer and open the lock
+ * file whose holder is the one doing the polling. */
+static int _shared_open(void)
+{
+    char name[256], path[PATH_MAX];
+    struct snapshot * snap = MAP_FAILED;
+    char * p;
+    int fd;
+
+    snprintf(name, sizeof(name), "/dkrfs-%s", _peername);
+    for (p = name + 1; *p; p++)
+        if (!isalnum((unsigned char)*p) && *p != '.' && *p != '-')
+            *p = '_';
+
+    fd = shm_open(name, O_RDWR | O_CREAT, 0660);
+    if (fd < 0)
+        return 0;
+
+    flock(fd, LOCK_EX);
+    if (ftruncate(fd, sizeof(struct snapshot)) == 0)
+        snap = mmap(NULL, sizeof(struct snapshot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (snap != MAP_FAILED && snap->magic != SNAPSHOT_MAGIC)
+        _snapshot_init(snap, 1);
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    if (snap == MAP_FAILED)
         return 0;
+    _snapshot = snap;
+
+    // only changes from here on are news to our subscribers and history
+    _snapshot_lock();
+    _delivered = _snapshot->generation;
+    _snapshot_unlock();
+
+    snprintf(path, sizeof(path), "%s%s.lock", _lockdir ? _lockdir : "/tmp", name);
+    _lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0660);
+    return _lock_fd >= 0;
+}
+
+static void _shared_close(void)
+{
+    if (_snapshot != &_local_snapshot) {
+        if (_leader) {
+            _snapshot_lock();
+            _snapshot->leader = 0;
+            _snapshot_unlock();
+        }
+        munmap(_snapshot, sizeof(struct snapshot));
+        _snapshot = &_local_snapshot;
     }
+    if (_lock_fd >= 0) {
+        close(_lock_fd);    // drops the lock, next follower takes over
+        _lock_fd = -1;
+    }
+    _leader = 0;
+}
 
-    return -ENOENT;
+static int _get_all(relay_state * s);
+static int _agent_start(void);
+static void _agent_stop(void);
+static int _export_start(void);
+static void _export_stop(void);
+static void _prefetch_start(void);
+static void _prefetch_stop(void);
+static int _audit_start(void);
+static void _history_start(void);
+
+/* Take over polling if nobody else is doing it, and poll if it's us */
+static void _poll(void)
+{
+    if (!_leader && (_lock_fd < 0 || flock(_lock_fd, LOCK_EX | LOCK_NB) == 0)) {
+        _leader = 1;
+        _snapshot_lock();
+        _snapshot->leader = getpid();
+        _snapshot_unlock();
+    }
+
+    if (_leader) {
+        relay_state s[MAX_RELAYS];
+        _get_all(s);
+    } else {
+        // pass on what the leader and other mounts have seen
+        _snapshot_lock();
+        _snapshot_deliver();
+        _snapshot_unlock();
+    }
 }
 
-static int _readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                         off_t offset, struct fuse_file_info *fi)
+/* Under the virtual clock there are no timers to wait on, so whatever
+ * drives the requests calls this between them to run anything that has
+ * fallen due: for now the poll. */
+static void _run_due(void)
 {
-    if(strcmp(path, "/") != 0)
-        return -ENOENT;
+    static uint64_t next_poll_ms = 0;
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    if (_poll_ms && _now_ms() >= next_poll_ms) {
+        _poll();
+        next_poll_ms = _now_ms() + _poll_ms;
+    }
+}
 
-    int i;
-    for (i = 0; i < _num_relays; i++) {
-        char fnam[16];
-        sprintf(fnam, "r%d", i + 1);
-        filler(buf, fnam, NULL, 0);
+static void * _poller(void * arg)
+{
+    struct timespec ts;
+
+    pthread_mutex_lock(&_poll_mutex);
+    while (_polling) {
+        pthread_mutex_unlock(&_poll_mutex);
+
+        _poll();
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += _poll_ms / 1000;
+        ts.tv_nsec += (_poll_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&_poll_mutex);
+        while (_polling && pthread_cond_timedwait(&_poll_cond, &_poll_mutex, &ts) != ETIMEDOUT)
+            ;
     }
+    pthread_mutex_unlock(&_poll_mutex);
 
-    return 0;
+    return NULL;
 }
 
-static int _open(const char *path, struct fuse_file_info *fi)
+static const struct backend * _backend;
+
+static void * _init(struct fuse_conn_info * conn)
+{
+    _mounted = 1;
+    if (_backend->start)
+        _backend->start();
+    if (_poll_ms) {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&_poll_cond, &attr);
+        pthread_condattr_destroy(&attr);
+
+        _polling = 1;
+        if (pthread_create(&_poll_thread, NULL, _poller, NULL))
+            _polling = 0;
+    }
+    if (_agent_addr)
+        _agent_start();
+    if (_export_addr)
+        _export_start();
+    if (_prefetch)
+        _prefetch_start();
+    if (_audit_path && !_audit_start()) {
+        // commands would go unlogged, so don't take any
+        fprintf(stderr, "dkrfs: can't start writing audit log %s\n", _audit_path);
+        fuse_exit(fuse_get_context()->fuse);
+    }
+    if (_history_dir)
+        _history_start();
+    return NULL;
+}
+
+/* Who made the fuse request this thread is handling, or NULL if fuse
+ * isn't running, as in a bench or soak run */
+static struct fuse_context * _context(void)
+{
+    return _mounted ? fuse_get_context() : NULL;
+}
+
+/* The SNMP side of the request path speaks SNMPv1 GET and SET itself
+ * rather than through net-snmp, whose PDUs are allocated and freed for
+ * every request.  Messages are built and parsed in each session's own
+ * buffers, so a read or write costs no heap at all.  BER is written back
+ * to front, since a length has to come before what it measures. */
+
+#define SNMP_PORT           "161"
+#define SNMP_TIMEOUT_MS     1000    // net-snmp's defaults
+#define SNMP_RETRIES        5
+#define SNMP_MAX_PACKET     1472
+
+#define BER_INTEGER         0x02
+#define BER_OCTET_STRING    0x04
+#define BER_NULL            0x05
+#define BER_OID             0x06
+#define BER_SEQUENCE        0x30
+#define BER_GET             0xa0
+#define BER_RESPONSE        0xa2
+#define BER_SET             0xa3
+
+struct ber {
+    unsigned char * start;
+    unsigned char * p;      // moves towards start as things are prepended
+    int overflow;
+};
+
+static void _ber_prepend(struct ber * b, const void * data, size_t n)
+{
+    if (b->overflow || (size_t)(b->p - b->start) < n) {
+        b->overflow = 1;
+        return;
+    }
+    b->p -= n;
+    memcpy(b->p, data, n);
+}
+
+static void _ber_byte(struct ber * b, unsigned char c)
+{
+    _ber_prepend(b, &c, 1);
+}
+
+/* Tag and length for the len bytes already prepended */
+static void _ber_header(struct ber * b, unsigned char tag, size_t len)
+{
+    if (len < 0x80)
+        _ber_byte(b, len);
+    else {
+        unsigned char n = 0;
+        for (; len; len >>= 8, n++)
+            _ber_byte(b, len & 0xff);
+        _ber_byte(b, 0x80 | n);
+    }
+    _ber_byte(b, tag);
+}
+
+static void _ber_integer(struct ber * b, long v)
+{
+    unsigned char * end = b->p;
+
+    do {
+        _ber_byte(b, v & 0xff);
+        v >>= 8;
+    } while (!(v == 0 && !(*b->p & 0x80)) && !(v == -1 && (*b->p & 0x80)) && !b->overflow);
+    _ber_header(b, BER_INTEGER, end - b->p);
+}
+
+static void _ber_oid(struct ber * b, const oid * id, size_t len)
+{
+    unsigned char * end = b->p;
+    size_t i;
+
+    for (i = len; i-- > 2;) {
+        unsigned long v = id[i];
+        _ber_byte(b, v & 0x7f);
+        while (v >>= 7)
+            _ber_byte(b, 0x80 | (v & 0x7f));
+    }
+    _ber_byte(b, len >= 2 ? id[0] * 40 + id[1] : 0);
+    _ber_header(b, BER_OID, end - b->p);
+}
+
+/* Step into the next element if it has the given tag, leaving *p at its
+ * contents and *len their length. */
+static int _ber_enter(const unsigned char ** p, const unsigned char * end, unsigned char tag, size_t * len)
+{
+    const unsigned char * q = *p;
+
+    if (end - q < 2 || *q++ != tag)
+        return 0;
+    if (*q < 0x80)
+        *len = *q++;
+    else {
+        unsigned int n = *q++ & 0x7f;
+        if (n > sizeof(size_t) || end - q < n)
+            return 0;
+        for (*len = 0; n; n--)
+            *len = *len << 8 | *q++;
+    }
+    if ((size_t)(end - q) < *len)
+        return 0;
+    *p = q;
+    return 1;
+}
+
+static int _ber_read_integer(const unsigned char ** p, const unsigned char * end, long * v)
+{
+    unsigned long u = 0;
+    size_t len, i;
+
+    if (!_ber_enter(p, end, BER_INTEGER, &len) || !len || len > sizeof(long))
+        return 0;
+    for (i = 0; i < len; i++)
+        u = u << 8 | (*p)[i];
+    if ((*p)[0] & 0x80 && len < sizeof(long))
+        u |= ~0UL << len * 8;       // sign extend
+    *v = (long)u;
+    *p += len;
+    return 1;
+}
+
+/* A socket to the device and room to build and take apart messages */
+struct snmp_conn {
+    int fd;                 // -1 if not open
+    int busy;
+    int32_t reqid;
+    uint64_t last_used;     // ms
+    unsigned char tx[SNMP_MAX_PACKET];
+    unsigned char rx[SNMP_MAX_PACKET];
+};
+
+/* Connections, one per concurrent request, opened when there's a request
+ * for them and, with -o idle=SECONDS, closed again by a reaper thread
+ * once unused for that long.  The reaper only runs while something is
+ * open, so a mount nobody is using holds no socket and no thread.  What
+ * was learnt about the device, its relays' states and round trip times,
+ * lives elsewhere and survives. */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned int open;
+    struct snmp_conn conns[LIMIT_MAX];
+    pthread_t reaper;
+    int reaper_state;       // 0 none, 1 running, 2 finished and waiting to be joined
+    int stopping;
+    pthread_cond_t reaper_cond;
+} _snmp_pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .reaper_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static const char * _snmp_peer;
+static const char * _snmp_community;
+static struct sockaddr_storage _snmp_addr;
+static socklen_t _snmp_addrlen;     // 0 until the peer has been looked up
+
+static void _record(struct capture_record * r, uint64_t start, int status, uint16_t bits)
 {
-    return _relay_from_path(path) >= 0 ? 0 : -ENOENT;
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    static uint64_t last = 0;
+    uint64_t now = _now_us();
+
+    r->rtt_us = now - start;
+    r->status = status;
+    if (r->command == CAPTURE_GET && r->status == CAPTURE_OK)
+        r->bits = bits;
+
+    pthread_mutex_lock(&mutex);
+    r->gap_us = !last ? 0 : start - last > UINT32_MAX ? UINT32_MAX : start - last;
+    last = start;
+    fwrite(r, sizeof(*r), 1, _record_file);
+    fflush(_record_file);
+    pthread_mutex_unlock(&mutex);
+}
+
+static int _snmp_resolve(const char * peer, struct sockaddr_storage * addr, socklen_t * addrlen);
+
+static int _snmp_conn_open(struct snmp_conn * c)
+{
+    if (!_snmp_addrlen && !_snmp_resolve(_snmp_peer, &_snmp_addr, &_snmp_addrlen)) {
+        fprintf(stderr, "dkrfs: can't find %s\n", _snmp_peer);
+        return 0;
+    }
+    c->fd = socket(_snmp_addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (c->fd < 0)
+        return 0;
+    if (connect(c->fd, (struct sockaddr *)&_snmp_addr, _snmp_addrlen)) {
+        close(c->fd);
+        c->fd = -1;
+        return 0;
+    }
+    c->reqid = (_now_us() ^ (uintptr_t)c) & 0x7fffffff;
+    return 1;
+}
+
+/* Close whatever has been idle too long, then sleep until the next might
+ * be, until nothing is left open */
+static void * _snmp_reaper(void * arg)
+{
+    pthread_mutex_lock(&_snmp_pool.mutex);
+    while (_snmp_pool.open && !_snmp_pool.stopping) {
+        uint64_t now = _now_ms(), next = 0;
+        struct timespec ts;
+        unsigned int i;
+
+        for (i = 0; i < LIMIT_MAX; i++) {
+            struct snmp_conn * c = &_snmp_pool.conns[i];
+            if (c->fd < 0 || c->busy)
+                continue;
+            if (now - c->last_used >= _idle_s * 1000ull) {
+                close(c->fd);
+                c->fd = -1;
+                _snmp_pool.open--;
+                STAT_INC(sessions_reaped);
+            } else if (!next || c->last_used + _idle_s * 1000ull < next)
+                next = c->last_used + _idle_s * 1000ull;
+        }
+        if (!_snmp_pool.open)
+            break;
+        if (!next)
+            next = now + _idle_s * 1000ull;    // all busy, look again later
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += (next - now) / 1000 + 1;
+        pthread_cond_timedwait(&_snmp_pool.reaper_cond, &_snmp_pool.mutex, &ts);
+    }
+    _snmp_pool.reaper_state = 2;
+    pthread_mutex_unlock(&_snmp_pool.mutex);
+
+    return NULL;
+}
+
+/* Called with the pool locked */
+static void _snmp_reaper_start(void)
+{
+    pthread_condattr_t attr;
+
+    if (_snmp_pool.reaper_state == 1)
+        return;
+    if (_snmp_pool.reaper_state == 2)
+        pthread_join(_snmp_pool.reaper, NULL);
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_snmp_pool.reaper_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    _snmp_pool.reaper_state = pthread_create(&_snmp_pool.reaper, NULL, _snmp_reaper, NULL) ? 0 : 1;
+}
+
+/* Take an idle connection, the most recently used so that any others
+ * go quiet and get reaped, or open another if the limit allows it, else
+ * wait for one.  Without a limit requests share a single connection,
+ * one at a time. */
+static struct snmp_conn * _snmp_conn_get(void)
+{
+    unsigned int max = _limit_adaptive ? LIMIT_MAX : _limit ? _limit : 1;
+    struct snmp_conn * c;
+    unsigned int i;
+
+    pthread_mutex_lock(&_snmp_pool.mutex);
+    for (;;) {
+        struct snmp_conn * closed = NULL;
+
+        c = NULL;
+        for (i = 0; i < LIMIT_MAX; i++) {
+            struct snmp_conn * t = &_snmp_pool.conns[i];
+            if (t->fd < 0) {
+                if (!closed)
+                    closed = t;
+            } else if (!t->busy && (!c || t->last_used > c->last_used))
+                c = t;
+        }
+        if (c)
+            break;
+        if (_snmp_pool.open < max && closed) {
+            if (!_snmp_conn_open(closed)) {
+                pthread_mutex_unlock(&_snmp_pool.mutex);
+                return NULL;
+            }
+            c = closed;
+            _snmp_pool.open++;
+            STAT_INC(sessions_opened);
+            if (_idle_s && !_virtual_clock)
+                _snmp_reaper_start();
+            break;
+        }
+        pthread_cond_wait(&_snmp_pool.cond, &_snmp_pool.mutex);
+    }
+    c->busy = 1;
+    pthread_mutex_unlock(&_snmp_pool.mutex);
+
+    return c;
+}
+
+static void _snmp_conn_put(struct snmp_conn * c)
+{
+    pthread_mutex_lock(&_snmp_pool.mutex);
+    c->busy = 0;
+    c->last_used = _now_ms();
+    pthread_cond_signal(&_snmp_pool.cond);
+    pthread_mutex_unlock(&_snmp_pool.mutex);
+}
+
+/* A GET of the relays in mask, or a SET of the one relay in it */
+static size_t _snmp_build(struct snmp_conn * c, unsigned char command, uint32_t mask, uint32_t values)
+{
+    struct ber b = { c->tx, c->tx + sizeof(c->tx), 0 };
+    unsigned char * end = b.p;
+    int i;
+
+    for (i = _num_relays - 1; i >= 0; i--) {
+        unsigned char * varbind = b.p;
+        if (!(mask & (1u << i)))
+            continue;
+        if (command == BER_SET)
+            _ber_integer(&b, !!(values & (1u << i)));
+        else
+            _ber_header(&b, BER_NULL, 0);
+        _ber_oid(&b, _oids[i].id, _oids[i].len);
+        _ber_header(&b, BER_SEQUENCE, varbind - b.p);
+    }
+    _ber_header(&b, BER_SEQUENCE, end - b.p);
+    _ber_integer(&b, 0);            // error-index
+    _ber_integer(&b, 0);            // error-status
+    _ber_integer(&b, c->reqid);
+    _ber_header(&b, command, end - b.p);
+    _ber_prepend(&b, _snmp_community, strlen(_snmp_community));
+    _ber_header(&b, BER_OCTET_STRING, strlen(_snmp_community));
+    _ber_integer(&b, 0);            // version-1
+    _ber_header(&b, BER_SEQUENCE, end - b.p);
+
+    if (b.overflow)
+        return 0;
+    // it was built at the end of the buffer
+    memmove(c->tx, b.p, end - b.p);
+    return end - b.p;
+}
+
+/* Take a response apart: CAPTURE_OK with the relay values in bits, if
+ * it answers this request; CAPTURE_ERROR if it's an error; -1 if it
+ * isn't ours. */
+/* Whether the OID encoded from p to end is relay i's */
+static int _snmp_is_oid(const unsigned char * p, const unsigned char * end, int i)
+{
+    unsigned char buf[MAX_OID_LEN * 5 + 4];
+    struct ber b = { buf, buf + sizeof(buf), 0 };
+
+    _ber_oid(&b, _oids[i].id, _oids[i].len);
+    return !b.overflow && end - p == buf + sizeof(buf) - b.p && !memcmp(p, b.p, end - p);
+}
+
+static int _snmp_parse(struct snmp_conn * c, size_t n, uint32_t mask, uint32_t * bits)
+{
+    const unsigned char * p = c->rx, * end = c->rx + n, * vend;
+    size_t len;
+    long v, reqid, errstat, erridx;
+    int i = 0;
+
+    if (!_ber_enter(&p, end, BER_SEQUENCE, &len) || !_ber_read_integer(&p, end, &v)
+            || !_ber_enter(&p, end, BER_OCTET_STRING, &len))
+        return -1;
+    p += len;
+    if (!_ber_enter(&p, end, BER_RESPONSE, &len) || !_ber_read_integer(&p, end, &reqid)
+            || reqid != c->reqid)
+        return -1;
+    if (!_ber_read_integer(&p, end, &errstat) || !_ber_read_integer(&p, end, &erridx) || errstat)
+        return CAPTURE_ERROR;
+    if (!_ber_enter(&p, end, BER_SEQUENCE, &len))
+        return CAPTURE_ERROR;
+
+    // values come back in the order they were asked for, or it's no answer
+    *bits = 0;
+    vend = p + len;
+    while (p < vend) {
+        const unsigned char * name;
+        while (i < _num_relays && !(mask & (1u << i)))
+            i++;
+        if (i == _num_relays || !_ber_enter(&p, vend, BER_SEQUENCE, &len))
+            return CAPTURE_ERROR;
+        end = p + len;
+        name = p;
+        if (!_ber_enter(&p, end, BER_OID, &len) || !_snmp_is_oid(name, p + len, i))
+            return CAPTURE_ERROR;
+        p += len;
+        if (!_ber_read_integer(&p, end, &v))
+            return CAPTURE_ERROR;
+        if (v)
+            *bits |= 1u << i;
+        p = end;
+        i++;
+    }
+    for (; i < _num_relays; i++)
+        if (mask & (1u << i))
+            return CAPTURE_ERROR;      // not everything answered
+    return CAPTURE_OK;
+}
+
+/* One request and its answer, with net-snmp's retries: the same message
+ * is resent until something answers it or the tries run out. */
+static int _snmp_request(unsigned char command, uint32_t mask, uint32_t values, uint32_t * bits)
+{
+    struct capture_record r;
+    struct perf_sample ps;
+    struct snmp_conn * c;
+    uint64_t start = 0;
+    size_t n;
+    int status = CAPTURE_TIMEOUT, tries;
+
+    *bits = 0;
+    if (!(c = _snmp_conn_get()))
+        return 0;
+    dkrfs_sent();
+
+    c->reqid = (c->reqid + 1) & 0x7fffffff;
+    _perf_begin(&ps);
+    n = _snmp_build(c, command, mask, values);
+    _perf_end(PERF_ENCODE, &ps);
+    if (!n) {
+        _snmp_conn_put(c);
+        return 0;
+    }
+
+    if (_record_file) {
+        memset(&r, 0, sizeof(r));
+        r.command = command == BER_SET ? CAPTURE_SET : CAPTURE_GET;
+        r.mask = mask;
+        r.bits = command == BER_SET ? values & mask : 0;
+        start = _now_us();
+    }
+
+    for (tries = 0; tries <= SNMP_RETRIES && status == CAPTURE_TIMEOUT; tries++) {
+        uint64_t deadline = _now_monotonic() + SNMP_TIMEOUT_MS * 1000;
+        uint64_t now;
+
+        if (tries) {
+            STAT_INC(retries);
+            if (_request)
+                __atomic_add_fetch(&_request->retries, 1, __ATOMIC_RELAXED);
+        }
+        if (send(c->fd, c->tx, n, 0) < 0) {
+            status = CAPTURE_ERROR;
+            break;
+        }
+        while (status == CAPTURE_TIMEOUT && (now = _now_monotonic()) < deadline) {
+            struct pollfd pfd = { c->fd, POLLIN, 0 };
+            ssize_t len;
+            int ret;
+
+            if (poll(&pfd, 1, (deadline - now + 999) / 1000) <= 0)
+                continue;
+            if ((len = recv(c->fd, c->rx, sizeof(c->rx), 0)) <= 0)
+                continue;
+            _perf_begin(&ps);
+            ret = _snmp_parse(c, len, mask, bits);
+            _perf_end(PERF_DECODE, &ps);
+            if (ret >= 0)
+                status = ret;
+        }
+    }
+    _snmp_conn_put(c);
+
+    if (_record_file)
+        _record(&r, start, status, *bits);
+    return status == CAPTURE_OK;
+}
+
+/* peer is [udp:|udp6:]host[:port], an IPv6 address being in brackets,
+ * or bare if there's no port */
+static int _snmp_resolve(const char * peer, struct sockaddr_storage * addr, socklen_t * addrlen)
+{
+    struct addrinfo hints, * ai;
+    char host[256];
+    const char * port = SNMP_PORT, * end;
+    int family = AF_UNSPEC;
+
+    if (!strncmp(peer, "udp:", 4))
+        peer += 4;
+    else if (!strncmp(peer, "udp6:", 5)) {
+        peer += 5;
+        family = AF_INET6;
+    }
+    if (*peer == '[') {
+        if (!(end = strchr(++peer, ']')))
+            return 0;
+        if (end[1] == ':')
+            port = end + 2;
+        else if (end[1])
+            return 0;
+    } else if ((end = strchr(peer, ':')) && !strchr(end + 1, ':'))
+        port = end + 1;
+    else
+        end = peer + strlen(peer);      // no port, or a bare IPv6 address
+    if ((size_t)(end - peer) >= sizeof(host))
+        return 0;
+    memcpy(host, peer, end - peer);
+    host[end - peer] = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, port, &hints, &ai))
+        return 0;
+    memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+    *addrlen = ai->ai_addrlen;
+    freeaddrinfo(ai);
+    return 1;
+}
+
+/* Nothing is looked up or opened until the first request */
+static int _snmp_open(const char * peer, unsigned int num_relays, const char * community)
+{
+    unsigned int i;
+
+    if (!community)
+        return 0;
+    _snmp_peer = peer;
+    _snmp_community = community;
+    _snmp_addrlen = 0;
+    for (i = 0; i < LIMIT_MAX; i++)
+        _snmp_pool.conns[i].fd = -1;
+
+    if (_record_path) {
+        struct capture_header h = { CAPTURE_MAGIC, CAPTURE_VERSION, num_relays };
+        _record_file = fopen(_record_path, "w");
+        if (!_record_file || fwrite(&h, sizeof(h), 1, _record_file) != 1) {
+            fprintf(stderr, "dkrfs: can't record to %s\n", _record_path);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void _snmp_close(void)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&_snmp_pool.mutex);
+    if (_snmp_pool.reaper_state) {
+        _snmp_pool.stopping = 1;
+        pthread_cond_signal(&_snmp_pool.reaper_cond);
+        pthread_mutex_unlock(&_snmp_pool.mutex);
+        pthread_join(_snmp_pool.reaper, NULL);
+        pthread_mutex_lock(&_snmp_pool.mutex);
+        _snmp_pool.reaper_state = 0;
+        _snmp_pool.stopping = 0;
+    }
+    for (i = 0; i < LIMIT_MAX; i++)
+        if (_snmp_pool.conns[i].fd >= 0) {
+            close(_snmp_pool.conns[i].fd);
+            _snmp_pool.conns[i].fd = -1;
+        }
+    _snmp_pool.open = 0;
+    pthread_mutex_unlock(&_snmp_pool.mutex);
+    if (_record_file) {
+        fclose(_record_file);
+        _record_file = NULL;
+    }
+}
+
+static int _snmp_set(int relay_num, relay_state s)
+{
+    uint32_t bits;
+    return _snmp_request(BER_SET, 1u << relay_num, s == relay_on ? 1u << relay_num : 0, &bits);
+}
+
+/* All in one SET */
+static int _snmp_set_mask(uint32_t mask, uint32_t bits)
+{
+    uint32_t got;
+    return _snmp_request(BER_SET, mask, bits, &got);
+}
+
+static int _snmp_get(int relay_num, relay_state * s)
+{
+    uint32_t bits;
+
+    if (!_snmp_request(BER_GET, 1u << relay_num, 0, &bits))
+        return 0;
+    *s = bits ? relay_on : relay_off;
+    return 1;
+}
+
+/* All relays in one request */
+static int _snmp_get_all(relay_state * s)
+{
+    uint32_t bits;
+    unsigned int i;
+
+    if (!_snmp_request(BER_GET, (1u << _num_relays) - 1, 0, &bits))
+        return 0;
+    for (i = 0; i < _num_relays; i++)
+        s[i] = bits & (1u << i) ? relay_on : relay_off;
+    return 1;
+}
+
+static const struct backend _snmp_backend = {
+    .name = "snmp",
+    .open = _snmp_open,
+    .close = _snmp_close,
+    .get = _snmp_get,
+    .set = _snmp_set,
+    .get_all = _snmp_get_all,
+    .set_mask = _snmp_set_mask,
+};
+
+static const struct backend * _backends[] = {
+    &_snmp_backend,
+    &remote_backend,
+    &http_backend,
+    &modbus_backend,
+    &replay_backend,
+    &stub_backend,
+    NULL
+};
+
+static const struct backend * _backend = &_snmp_backend;
+
+/* Fleet: with -o fleet=FILE, reading .fleet GETs every relay of every
+ * board listed in FILE at once, all boards in parallel over SNMP with
+ * this mount's community and relay count, and answers with whatever
+ * came back within -o fleet_deadline.  Unanswered GETs are resent every
+ * FLEET_RESEND_MS until then.  Reads while a sweep is under way wait for
+ * it and share its answer rather than starting another. */
+
+#define FLEET_MAX       64
+#define FLEET_RESEND_MS 250
+
+struct fleet_result {
+    int status;
+    uint32_t bits;
+    uint64_t rtt_us;
+};
+
+/* A sweep works on sweep without the lock, there being only one at a
+ * time, and copies it to shown under the lock when it's done; readers
+ * only ever look at shown. */
+struct fleet_board {
+    char name[32];
+    char peer[128];
+    struct sockaddr_storage addr;
+    socklen_t addrlen;          // 0 until looked up
+    int fd;
+    int32_t reqid;
+    struct fleet_result sweep;
+    struct fleet_result shown;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int sweeping;
+    uint64_t sweeps;
+    uint64_t elapsed_us;        // of the last sweep
+    unsigned int count;
+    struct fleet_board * boards;
+    struct snmp_conn conn;      // just for its buffers
+} _fleet = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/* FILE has a board per line, a name and its address, host[:port]; blank
+ * lines and those starting with # are skipped. */
+static int _fleet_load(void)
+{
+    FILE * f = fopen(_fleet_path, "r");
+    char line[256];
+
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        struct fleet_board * b;
+        char name[32], peer[128];
+
+        if (line[0] == '#' || sscanf(line, "%31s %127s", name, peer) != 2)
+            continue;
+        if (_fleet.count == FLEET_MAX) {
+            fprintf(stderr, "dkrfs: only the first %d boards in %s are swept\n", FLEET_MAX, _fleet_path);
+            break;
+        }
+        if (!(b = realloc(_fleet.boards, (_fleet.count + 1) * sizeof(*b)))) {
+            fclose(f);
+            return 0;
+        }
+        _fleet.boards = b;
+        b += _fleet.count;
+        memset(b, 0, sizeof(*b));
+        strcpy(b->name, name);
+        strcpy(b->peer, peer);
+        b->fd = -1;
+        _fleet.count++;
+    }
+    fclose(f);
+    return 1;
+}
+
+static void _fleet_send(struct fleet_board * b)
+{
+    struct snmp_conn * c = &_fleet.conn;
+    size_t n;
+
+    c->reqid = b->reqid;
+    if (!(n = _snmp_build(c, BER_GET, (1u << _num_relays) - 1, 0)) || send(b->fd, c->tx, n, 0) < 0) {
+        b->sweep.status = CAPTURE_ERROR;
+        close(b->fd);
+        b->fd = -1;
+    }
+}
+
+/* Called with the fleet unlocked but marked as sweeping.  Returns how
+ * long it took. */
+static uint64_t _fleet_sweep(void)
+{
+    struct pollfd pfd[FLEET_MAX];
+    struct fleet_board * on[FLEET_MAX];
+    uint64_t start = _now_us(), deadline = start + _fleet_deadline_ms * 1000ull;
+    uint64_t resend = start + FLEET_RESEND_MS * 1000;
+    unsigned int i, pending = 0;
+
+    for (i = 0; i < _fleet.count; i++) {
+        struct fleet_board * b = &_fleet.boards[i];
+
+        b->sweep.status = CAPTURE_TIMEOUT;
+        b->sweep.bits = 0;
+        b->sweep.rtt_us = 0;
+        b->reqid = (_fleet.conn.reqid + 1 + i) & 0x7fffffff;
+        if (!b->addrlen && !_snmp_resolve(b->peer, &b->addr, &b->addrlen)) {
+            b->sweep.status = CAPTURE_ERROR;
+            continue;
+        }
+        b->fd = socket(b->addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (b->fd >= 0 && connect(b->fd, (struct sockaddr *)&b->addr, b->addrlen)) {
+            close(b->fd);
+            b->fd = -1;
+        }
+        if (b->fd < 0) {
+            b->sweep.status = CAPTURE_ERROR;
+            continue;
+        }
+        _fleet_send(b);
+    }
+    _fleet.conn.reqid = (_fleet.conn.reqid + _fleet.count) & 0x7fffffff;
+
+    for (;;) {
+        uint64_t now = _now_us(), until;
+
+        if (now >= deadline)
+            break;
+        if (now >= resend) {
+            for (i = 0; i < _fleet.count; i++)
+                if (_fleet.boards[i].fd >= 0)
+                    _fleet_send(&_fleet.boards[i]);
+            resend = now + FLEET_RESEND_MS * 1000;
+        }
+
+        for (i = pending = 0; i < _fleet.count; i++)
+            if (_fleet.boards[i].fd >= 0) {
+                on[pending] = &_fleet.boards[i];
+                pfd[pending].fd = _fleet.boards[i].fd;
+                pfd[pending].events = POLLIN;
+                pending++;
+            }
+        if (!pending)
+            break;
+
+        until = resend < deadline ? resend : deadline;
+        if (poll(pfd, pending, (until - now + 999) / 1000) <= 0)
+            continue;
+        for (i = 0; i < pending; i++) {
+            struct fleet_board * b = on[i];
+            struct snmp_conn * c = &_fleet.conn;
+            ssize_t len;
+            int ret;
+
+            if (!(pfd[i].revents & (POLLIN | POLLERR)))
+                continue;
+            if ((len = recv(b->fd, c->rx, sizeof(c->rx), 0)) <= 0) {
+                if (len < 0 && errno != ECONNREFUSED)
+                    continue;
+                ret = CAPTURE_ERROR;   // nothing listening
+            } else {
+                c->reqid = b->reqid;
+                if ((ret = _snmp_parse(c, len, (1u << _num_relays) - 1, &b->sweep.bits)) < 0)
+                    continue;
+            }
+            b->sweep.status = ret;
+            b->sweep.rtt_us = _now_us() - start;
+            close(b->fd);
+            b->fd = -1;
+        }
+    }
+
+    for (i = 0; i < _fleet.count; i++)
+        if (_fleet.boards[i].fd >= 0) {
+            close(_fleet.boards[i].fd);
+            _fleet.boards[i].fd = -1;
+        }
+    return _now_us() - start;
+}
+
+static pthread_mutex_t _queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _queue_cond;
+static pthread_cond_t _limit_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int _queued = 0;
+static unsigned int _active = 0;
+
+/* The adaptive window and what it's judged by: the quickest round trip
+ * seen lately, which is taken as the device's unloaded latency.  The
+ * minimum is restarted every RTT_MIN_SAMPLES so it follows the device if
+ * it gets slower for good. */
+#define RTT_MIN_SAMPLES 256
+#define RTT_TOLERANCE   2       // inflation over the minimum that means queueing
+
+static double _window = 1;
+static uint64_t _rtt_min = 0, _rtt_min_next = 0;
+static unsigned int _rtt_samples = 0;
+static uint64_t _decreased_at = 0;
+
+static void _queue_init(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_queue_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static struct fuse_context * _context(void);
+
+static void _request_add(struct request * rq, int type, uint32_t mask)
+{
+    struct fuse_context * ctx = _context();
+
+    rq->queued_us = _now_us();
+    rq->admitted_us = 0;
+    rq->sent_us = 0;
+    rq->mask = mask;
+    rq->retries = 0;
+    rq->pid = ctx ? ctx->pid : 0;
+    rq->type = type;
+    rq->next = NULL;
+
+    pthread_mutex_lock(&_requests.mutex);
+    rq->prev = _requests.tail;
+    if (rq->prev)
+        rq->prev->next = rq;
+    else
+        _requests.head = rq;
+    _requests.tail = rq;
+    pthread_mutex_unlock(&_requests.mutex);
+}
+
+static void _request_remove(struct request * rq)
+{
+    pthread_mutex_lock(&_requests.mutex);
+    if (rq->prev)
+        rq->prev->next = rq->next;
+    else
+        _requests.head = rq->next;
+    if (rq->next)
+        rq->next->prev = rq->prev;
+    else
+        _requests.tail = rq->prev;
+    pthread_mutex_unlock(&_requests.mutex);
+}
+
+/* Admission control: every request to the device is bracketed by
+ * _request_begin() and _request_end(), and no more than _queue_max may
+ * be between the two, whether waiting for the session or at the device.
+ * Returns 0 with the request listed and its start time set, or -EBUSY
+ * if there's no room. */
+static int _request_begin(struct request * rq, int type, uint32_t mask)
+{
+    _request_add(rq, type, mask);
+
+    if (_queue_max || _limit) {
+        pthread_mutex_lock(&_queue_mutex);
+        if (_queue_max && _queued >= _queue_max && _overload == overload_block) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += _overload_timeout_ms / 1000;
+            ts.tv_nsec += (_overload_timeout_ms % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            STAT_INC(blocked);
+            while (_queued >= _queue_max
+                   && pthread_cond_timedwait(&_queue_cond, &_queue_mutex, &ts) != ETIMEDOUT)
+                ;
+        }
+        if (_queue_max && _queued >= _queue_max) {
+            pthread_mutex_unlock(&_queue_mutex);
+            _request_remove(rq);
+            STAT_INC(rejected);
+            return -EBUSY;
+        }
+        _queued++;
+        while (_limit && _active >= (unsigned int)_window)
+            pthread_cond_wait(&_limit_cond, &_queue_mutex);
+        _active++;
+        pthread_mutex_unlock(&_queue_mutex);
+    }
+
+    uint32_t n = __atomic_add_fetch(&_stats.inflight, 1, __ATOMIC_RELAXED);
+    uint32_t max = __atomic_load_n(&_stats.inflight_max, __ATOMIC_RELAXED);
+    while (n > max && !__atomic_compare_exchange_n(&_stats.inflight_max, &max, n, 1,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    rq->admitted_us = _now_us();
+    _request = rq;
+    return 0;
+}
+
+/* Called by a backend once the request it's carrying out on this thread
+ * has a connection or slot of its own and goes to the device, so that
+ * .queue tells waiting for one from waiting on the device. */
+void dkrfs_sent(void)
+{
+    if (_request)
+        __atomic_store_n(&_request->sent_us, _now_us(), __ATOMIC_RELAXED);
+}
+
+/* Additive increase while replies come back near the unloaded latency
+ * and the window is actually being used, multiplicative decrease when
+ * they don't: halve on a failure, which is most likely a timeout, and
+ * back off by a tenth when the round trip has inflated.  Only requests
+ * sent after the last decrease can cause another, so one congested
+ * round trip costs one step down, not one per request in it.  Called
+ * with _queue_mutex held. */
+static void _limit_adapt(uint64_t start, uint64_t rtt, int ok)
+{
+    if (ok) {
+        if (!_rtt_min_next || rtt < _rtt_min_next)
+            _rtt_min_next = rtt;
+        if (++_rtt_samples >= RTT_MIN_SAMPLES) {
+            _rtt_min = _rtt_min_next;
+            _rtt_min_next = 0;
+            _rtt_samples = 0;
+        } else if (!_rtt_min || rtt < _rtt_min)
+            _rtt_min = rtt;
+    }
+
+    if (ok && rtt <= _rtt_min * RTT_TOLERANCE) {
+        if (_active + 1 >= (unsigned int)_window / 2 && _window < _limit)
+            _window += 1 / _window;
+    } else if (start >= _decreased_at) {
+        _window *= ok ? 0.9 : 0.5;
+        if (_window < 1)
+            _window = 1;
+        _decreased_at = _now_us();
+        STAT_INC(limit_decreases);
+    }
+}
+
+/* Returns 0 if ok, else -EIO */
+static int _request_end(struct request * rq, int ok)
+{
+    uint64_t sent = __atomic_load_n(&rq->sent_us, __ATOMIC_RELAXED);
+    uint64_t start = sent ? sent : rq->admitted_us;
+    uint64_t rtt = _now_us() - start;
+    int bucket = 0;
+
+    _request = NULL;
+    _request_remove(rq);
+
+    if (_queue_max || _limit) {
+        pthread_mutex_lock(&_queue_mutex);
+        _queued--;
+        _active--;
+        if (_limit_adaptive)
+            _limit_adapt(start, rtt, ok);
+        pthread_cond_signal(&_queue_cond);
+        pthread_cond_broadcast(&_limit_cond);
+        pthread_mutex_unlock(&_queue_mutex);
+    }
+
+    while (rtt > 1 && bucket < RTT_BUCKETS - 1) {
+        rtt >>= 1;
+        bucket++;
+    }
+    STAT_INC(rtt[bucket]);
+    STAT_INC(requests);
+    if (!ok)
+        STAT_INC(request_errors);
+    __atomic_sub_fetch(&_stats.inflight, 1, __ATOMIC_RELAXED);
+    return ok ? 0 : -EIO;
+}
+
+static void _prefetch_invalidate(int relay_num);
+
+/* The relay operations below return 0, -EIO if the device couldn't be
+ * asked or -EBUSY if it's overloaded. */
+
+/* Sets hold this shared and compare-and-sets exclusively, so that nothing
+ * set through this mount comes between a compare and its set. */
+static pthread_rwlock_t _set_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int _set_relay(int relay_num, relay_state s)
+{
+    struct request rq;
+    int err;
+
+    _prefetch_invalidate(relay_num);
+    // taken before a place at the device, as a compare-and-set does
+    pthread_rwlock_rdlock(&_set_lock);
+    if (!(err = _request_begin(&rq, REQUEST_SET, 1u << relay_num)))
+        err = _request_end(&rq, _backend->set(relay_num, s));
+    pthread_rwlock_unlock(&_set_lock);
+    if (err)
+        return err;
+    _snapshot_store(1u << relay_num, s == relay_on ? 1u << relay_num : 0, 0, _snapshot_ticket());
+    return 0;
+}
+
+/* Called with _set_lock held */
+static int _set_mask_locked(uint32_t mask, uint32_t bits)
+{
+    struct request rq;
+    unsigned int i;
+    int err, ok = 1;
+
+    for (i = 0; i < _num_relays; i++)
+        if (mask & (1u << i))
+            _prefetch_invalidate(i);
+    if ((err = _request_begin(&rq, REQUEST_SET_MASK, mask)))
+        return err;
+    if (_backend->set_mask)
+        ok = _backend->set_mask(mask, bits);
+    else
+        for (i = 0; ok && i < _num_relays; i++)
+            if (mask & (1u << i))
+                ok = _backend->set(i, bits & (1u << i) ? relay_on : relay_off);
+    if ((err = _request_end(&rq, ok)))
+        return err;
+    _snapshot_store(mask, bits & mask, 0, _snapshot_ticket());
+    return 0;
+}
+
+/* The relays in mask to their bits in bits, together */
+static int _set_mask(uint32_t mask, uint32_t bits)
+{
+    int err;
+
+    pthread_rwlock_rdlock(&_set_lock);
+    err = _set_mask_locked(mask, bits);
+    pthread_rwlock_unlock(&_set_lock);
+    return err;
+}
+
+static int _get_relay(int relay_num, relay_state * s)
+{
+    struct request rq;
+    int err;
+
+    if (_snapshot_load(relay_num, s)) {
+        STAT_INC(cache_hits);
+        return 0;
+    }
+    STAT_INC(cache_misses);
+
+    if ((err = _request_begin(&rq, REQUEST_GET, 1u << relay_num))) {
+        if (_overload == overload_stale && _snapshot_last(relay_num, s)) {
+            STAT_INC(stale_served);
+            return 0;
+        }
+        return err;
+    }
+    _ticket = _snapshot_ticket();
+    err = _request_end(&rq, _backend->get(relay_num, s));
+    if (!err) {
+        uint32_t bits = _snapshot_store(1u << relay_num, *s == relay_on ? 1u << relay_num : 0, 0, _ticket);
+        *s = bits & (1u << relay_num) ? relay_on : relay_off;
+    }
+    _ticket = 0;
+    return err;
+}
+
+/* Every relay at once, which counts as a poll of the whole device. */
+static int _get_all(relay_state * s)
+{
+    struct request rq;
+    int err;
+
+    if ((err = _request_begin(&rq, REQUEST_GET_ALL, (1u << _num_relays) - 1)))
+        return err;
+    _ticket = _snapshot_ticket();
+    err = _request_end(&rq, _backend->get_all(s));
+    if (!err) {
+        uint32_t bits = _snapshot_store((1u << _num_relays) - 1, dkrfs_bits(s, _num_relays), 1, _ticket);
+        unsigned int i;
+        for (i = 0; i < _num_relays; i++)
+            s[i] = bits & (1u << i) ? relay_on : relay_off;
+    }
+    _ticket = 0;
+    return err;
+}
+
+/* If the relays in mask are as in expect, set them to bits: 1 if they
+ * were set, 0 if not, else an error as above.  found is what they were. */
+static int _cas_mask(uint32_t mask, uint32_t expect, uint32_t bits, uint32_t * found)
+{
+    relay_state s[MAX_RELAYS];
+    int err;
+
+    pthread_rwlock_wrlock(&_set_lock);
+    if (!(err = _get_all(s))) {
+        *found = dkrfs_bits(s, _num_relays) & mask;
+        if (*found == (expect & mask) && !(err = _set_mask_locked(mask, bits)))
+            err = 1;
+    }
+    pthread_rwlock_unlock(&_set_lock);
+    return err;
+}
+
+/* Prefetch: start reading a relay when it's opened, so the device round
+ * trip overlaps the rest of the open/read exchange with the kernel, and
+ * read the whole board in one go when relays are being opened in turn.
+ * A read uses a prefetched value if the fetch started after the file was
+ * opened, or for a scan, no more than SCAN_WINDOW before. */
+
+#define SCAN_WINDOW_US  200000
+#define SCAN_LENGTH     3       // consecutive relays opened to call it a scan
+
+static struct {
+    uint64_t started;       // 0 if nothing usable
+    unsigned int gen;       // bumped by writes, so older fetches are dropped
+    int busy;
+    int ok;
+    relay_state s;
+} _prefetched[MAX_RELAYS];
+
+static uint32_t _prefetch_pending = 0;
+static int _prefetch_running = 0;
+static pthread_t _prefetch_thread;
+static pthread_mutex_t _prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+static int _scan_last = -1;
+static unsigned int _scan_run = 0;
+static uint64_t _scan_at = 0;
+
+static void _prefetch_invalidate(int relay_num)
+{
+    if (!_prefetch)
+        return;
+    pthread_mutex_lock(&_prefetch_mutex);
+    _prefetched[relay_num].gen++;
+    _prefetched[relay_num].started = 0;
+    pthread_mutex_unlock(&_prefetch_mutex);
+}
+
+static void * _prefetcher(void * arg)
+{
+    pthread_mutex_lock(&_prefetch_mutex);
+    while (_prefetch_running) {
+        relay_state s[MAX_RELAYS];
+        unsigned int gen[MAX_RELAYS];
+        uint32_t mask = _prefetch_pending;
+        uint64_t now = _now_us();
+        int i, ok, single = -1;
+
+        if (!mask) {
+            pthread_cond_wait(&_prefetch_cond, &_prefetch_mutex);
+            continue;
+        }
+
+        if (!(mask & (mask - 1)))
+            single = __builtin_ctz(mask);
+        else
+            mask = (1u << _num_relays) - 1;
+        _prefetch_pending &= ~mask;
+
+        for (i = 0; i < _num_relays; i++)
+            if (mask & (1u << i)) {
+                _prefetched[i].busy = 1;
+                _prefetched[i].started = now;
+                gen[i] = _prefetched[i].gen;
+            }
+        pthread_mutex_unlock(&_prefetch_mutex);
+
+        if (single >= 0) {
+            STAT_INC(prefetches);
+            ok = !_get_relay(single, &s[single]);
+        } else {
+            STAT_INC(board_prefetches);
+            ok = !_get_all(s);
+        }
+
+        pthread_mutex_lock(&_prefetch_mutex);
+        for (i = 0; i < _num_relays; i++)
+            if (mask & (1u << i)) {
+                _prefetched[i].busy = 0;
+                _prefetched[i].ok = ok;
+                _prefetched[i].s = s[i];
+                if (gen[i] != _prefetched[i].gen)
+                    _prefetched[i].started = 0;
+            }
+        pthread_cond_broadcast(&_prefetch_cond);
+    }
+    pthread_mutex_unlock(&_prefetch_mutex);
+
+    return NULL;
+}
+
+/* Called on open for reading; returns the oldest fetch start time a read
+ * through this open may use. */
+static uint64_t _prefetch_open(int relay_num)
+{
+    uint64_t now = _now_us(), oldest = now;
+    relay_state s;
+
+    pthread_mutex_lock(&_prefetch_mutex);
+    if (relay_num == _scan_last + 1 && now - _scan_at < SCAN_WINDOW_US)
+        _scan_run++;
+    else
+        _scan_run = 1;
+    _scan_last = relay_num;
+    _scan_at = now;
+
+    if (_scan_run >= SCAN_LENGTH) {
+        oldest = now - SCAN_WINDOW_US;
+        if (_prefetched[relay_num].started < oldest && !_prefetched[relay_num].busy)
+            _prefetch_pending |= (1u << _num_relays) - 1;
+    } else if (!_snapshot_load(relay_num, &s))
+        _prefetch_pending |= 1u << relay_num;
+    pthread_cond_broadcast(&_prefetch_cond);
+    pthread_mutex_unlock(&_prefetch_mutex);
+
+    return oldest;
+}
+
+/* The prefetched state of a relay if there's a usable one, waiting for
+ * it if it's on its way. */
+static int _prefetch_read(int relay_num, uint64_t oldest, relay_state * s)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&_prefetch_mutex);
+    while (_prefetch_running && ((_prefetch_pending & (1u << relay_num))
+                                 || (_prefetched[relay_num].busy && _prefetched[relay_num].started >= oldest)))
+        pthread_cond_wait(&_prefetch_cond, &_prefetch_mutex);
+    if (_prefetched[relay_num].started >= oldest && _prefetched[relay_num].ok) {
+        *s = _prefetched[relay_num].s;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&_prefetch_mutex);
+
+    if (ret)
+        STAT_INC(prefetch_hits);
+    return ret;
+}
+
+static void _prefetch_start(void)
+{
+    _prefetch_running = 1;
+    if (pthread_create(&_prefetch_thread, NULL, _prefetcher, NULL))
+        _prefetch_running = 0;
+}
+
+static void _prefetch_stop(void)
+{
+    if (!_prefetch_running)
+        return;
+    pthread_mutex_lock(&_prefetch_mutex);
+    _prefetch_running = 0;
+    pthread_cond_broadcast(&_prefetch_cond);
+    pthread_mutex_unlock(&_prefetch_mutex);
+    pthread_join(_prefetch_thread, NULL);
+}
+
+/* Audit log: a line for every command to a relay, from whichever side it
+ * came, with its outcome.  A command isn't answered until its line is on
+ * disk, but callers don't each pay for a sync: one thread writes out
+ * whatever has queued up since its last batch and syncs once for the lot,
+ * so under a burst of writes the cost is shared. */
+
+static int _audit_fd = -1;
+static pthread_t _audit_thread;
+static int _auditing = 0;
+static int _audit_broken = 0;       // once a batch has failed, so has everything after
+static pthread_mutex_t _audit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _audit_queued_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t _audit_committed_cond = PTHREAD_COND_INITIALIZER;
+static char * _audit_buf[2];
+static size_t _audit_len, _audit_size[2];
+static uint64_t _audit_queued, _audit_committed;    // entry sequence numbers
+
+static void * _auditor(void * arg)
+{
+    pthread_mutex_lock(&_audit_mutex);
+    while (_auditing || _audit_len) {
+        char * buf;
+        size_t len, size, done = 0;
+        uint64_t upto;
+        int ok = 1;
+
+        if (!_audit_len) {
+            pthread_cond_wait(&_audit_queued_cond, &_audit_mutex);
+            continue;
+        }
+
+        // take the batch, leaving the other buffer for the next one
+        buf = _audit_buf[0];
+        len = _audit_len;
+        _audit_buf[0] = _audit_buf[1];
+        _audit_buf[1] = buf;
+        size = _audit_size[0];
+        _audit_size[0] = _audit_size[1];
+        _audit_size[1] = size;
+        _audit_len = 0;
+        upto = _audit_queued;
+        pthread_mutex_unlock(&_audit_mutex);
+
+        while (ok && done < len) {
+            ssize_t n = write(_audit_fd, buf + done, len - done);
+            if (n < 0 && errno != EINTR)
+                ok = 0;
+            else if (n > 0)
+                done += n;
+        }
+        if (ok && fdatasync(_audit_fd))
+            ok = 0;
+        STAT_INC(audit_commits);
+
+        pthread_mutex_lock(&_audit_mutex);
+        if (!ok && !_audit_broken) {
+            fprintf(stderr, "dkrfs: can't write audit log %s: %s\n", _audit_path, strerror(errno));
+            _audit_broken = 1;
+        }
+        _audit_committed = upto;
+        pthread_cond_broadcast(&_audit_committed_cond);
+    }
+    pthread_mutex_unlock(&_audit_mutex);
+
+    return NULL;
+}
+
+/* Queue a command for the log, with seq set to when it will have been
+ * committed, or 0 if there's no log to commit it to.  Returns 0, or -EIO
+ * if it couldn't be queued, or the log isn't being written. */
+static int _audit_queue(const char * who, int relay_num, relay_state s, int err, uint64_t * seq)
+{
+    char line[160];
+    struct timespec now;
+    struct tm tm;
+    int n;
+
+    *seq = 0;
+    if (_audit_fd < 0)
+        return 0;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    gmtime_r(&now.tv_sec, &tm);
+    n = strftime(line, sizeof(line), "%Y-%m-%dT%H:%M:%S", &tm);
+    n += snprintf(line + n, sizeof(line) - n, ".%06ldZ r%d %d %s %s\n", now.tv_nsec / 1000,
+                  relay_num + 1, s == relay_on, !err ? "ok" : err == -EBUSY ? "busy" : "failed", who);
+    if (n >= (int)sizeof(line))
+        n = sizeof(line) - 1;
+
+    pthread_mutex_lock(&_audit_mutex);
+    if (!_auditing) {
+        pthread_mutex_unlock(&_audit_mutex);
+        return -EIO;    // there's a log, but nothing writing it
+    }
+    if (_audit_len + n > _audit_size[0]) {
+        size_t size = _audit_size[0] ? _audit_size[0] * 2 : 4096;
+        char * buf = realloc(_audit_buf[0], size);
+        if (!buf) {
+            pthread_mutex_unlock(&_audit_mutex);
+            return -EIO;
+        }
+        _audit_buf[0] = buf;
+        _audit_size[0] = size;
+    }
+    memcpy(_audit_buf[0] + _audit_len, line, n);
+    _audit_len += n;
+    *seq = ++_audit_queued;
+    STAT_INC(audit_entries);
+    pthread_cond_signal(&_audit_queued_cond);
+    pthread_mutex_unlock(&_audit_mutex);
+
+    return 0;
+}
+
+/* Wait for the log to be committed up to seq.  Returns 0, or -EIO if it
+ * couldn't be. */
+static int _audit_wait(uint64_t seq)
+{
+    int err;
+
+    if (!seq)
+        return 0;
+    pthread_mutex_lock(&_audit_mutex);
+    while (_audit_committed < seq)
+        pthread_cond_wait(&_audit_committed_cond, &_audit_mutex);
+    err = _audit_broken ? -EIO : 0;
+    pthread_mutex_unlock(&_audit_mutex);
+
+    return err;
+}
+
+/* Log a command and wait for it to be committed.  Returns 0, or -EIO if
+ * it couldn't be. */
+static int _audit(const char * who, int relay_num, relay_state s, int err)
+{
+    uint64_t seq;
+
+    if ((err = _audit_queue(who, relay_num, s, err, &seq)))
+        return err;
+    return _audit_wait(seq);
+}
+
+/* A command from any source: carried out, then logged */
+static int _command(const char * who, int relay_num, relay_state s)
+{
+    int err = _set_relay(relay_num, s);
+    int audit_err = _audit(who, relay_num, s, err);
+    return err ? err : audit_err;
+}
+
+static int _audit_open(void)
+{
+    _audit_fd = open(_audit_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+    return _audit_fd >= 0;
+}
+
+static int _audit_start(void)
+{
+    _auditing = 1;
+    if (pthread_create(&_audit_thread, NULL, _auditor, NULL))
+        _auditing = 0;
+    return _auditing;
+}
+
+static void _audit_stop(void)
+{
+    if (_auditing) {
+        pthread_mutex_lock(&_audit_mutex);
+        _auditing = 0;
+        pthread_cond_signal(&_audit_queued_cond);
+        pthread_mutex_unlock(&_audit_mutex);
+        pthread_join(_audit_thread, NULL);
+    }
+    if (_audit_fd >= 0) {
+        close(_audit_fd);
+        _audit_fd = -1;
+    }
+    free(_audit_buf[0]);
+    free(_audit_buf[1]);
+}
+
+/* History: every change of state appended to a log in DIR, split into a
+ * segment a day so old ones can be dropped whole.  See dkrfs.h for the
+ * format and dkrfs-history for reading it.  Nothing is synced; a crash
+ * can lose the last few changes, not the file. */
+
+#define HISTORY_SEGMENT_S   (24 * 3600)
+#define HISTORY_CHECK_S     3600        // between looks for segments past keeping
+
+static int _history_fd = -1;
+static time_t _history_started;         // of the current segment
+static uint64_t _history_last_us;       // records never go backwards, even if the clock does
+static pthread_mutex_t _history_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t _history_thread;
+static int _history_running = 0;
+static pthread_cond_t _history_cond;
+
+static int _history_segment(const struct timespec * now)
+{
+    struct history_header h = { HISTORY_MAGIC, HISTORY_VERSION, _num_relays, 0 };
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (_history_fd >= 0)
+        close(_history_fd);
+
+    h.start_us = (uint64_t)now->tv_sec * 1000000 + now->tv_nsec / 1000;
+    snprintf(path, sizeof(path), "%s/%010lld" HISTORY_SUFFIX, _history_dir, (long long)now->tv_sec);
+    _history_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    // carry on with a segment started this same second, less any torn record
+    if (_history_fd >= 0 && !fstat(_history_fd, &st) && st.st_size >= (off_t)sizeof(h)) {
+        if (st.st_size % sizeof(struct history_record))
+            ftruncate(_history_fd, st.st_size - st.st_size % sizeof(struct history_record));
+    } else if (_history_fd < 0 || write(_history_fd, &h, sizeof(h)) != sizeof(h)) {
+        fprintf(stderr, "dkrfs: can't start history segment %s: %s\n", path, strerror(errno));
+        if (_history_fd >= 0)
+            close(_history_fd);
+        _history_fd = -1;
+        return 0;
+    }
+    _history_started = now->tv_sec;
+    return 1;
+}
+
+static void _history_append(uint32_t bits, uint32_t known)
+{
+    struct history_record r = { 0, bits, known };
+    struct timespec now;
+
+    if (!_history_dir)
+        return;
+
+    _now_real(&now);
+    r.time_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+    pthread_mutex_lock(&_history_mutex);
+    if (r.time_us < _history_last_us)
+        r.time_us = _history_last_us;
+    _history_last_us = r.time_us;
+    if ((_history_fd >= 0 && now.tv_sec - _history_started < HISTORY_SEGMENT_S)
+            || _history_segment(&now)) {
+        if (write(_history_fd, &r, sizeof(r)) != sizeof(r)) {
+            // a torn record would misalign everything after it
+            close(_history_fd);
+            _history_fd = -1;
+        }
+    }
+    pthread_mutex_unlock(&_history_mutex);
+}
+
+static int _history_filter(const struct dirent * d)
+{
+    size_t len = strlen(d->d_name), suffix = strlen(HISTORY_SUFFIX);
+    return len > suffix && !strcmp(d->d_name + len - suffix, HISTORY_SUFFIX);
+}
+
+/* Drop segments that ended before the keeping period: any whose
+ * successor started before it.  The newest is never dropped. */
+static void _history_expire(void)
+{
+    struct dirent ** names;
+    time_t horizon = time(NULL) - (time_t)_history_keep_days * 24 * 3600;
+    int n, i;
+
+    if ((n = scandir(_history_dir, &names, _history_filter, alphasort)) < 0)
+        return;
+    for (i = 0; i < n; i++) {
+        if (i + 1 < n && atoll(names[i + 1]->d_name) < horizon) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", _history_dir, names[i]->d_name);
+            unlink(path);
+        }
+        free(names[i]);
+    }
+    free(names);
+}
+
+static void * _history_keeper(void * arg)
+{
+    struct timespec ts;
+
+    pthread_mutex_lock(&_history_mutex);
+    while (_history_running) {
+        pthread_mutex_unlock(&_history_mutex);
+        _history_expire();
+        pthread_mutex_lock(&_history_mutex);
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += HISTORY_CHECK_S;
+        while (_history_running && pthread_cond_timedwait(&_history_cond, &_history_mutex, &ts) != ETIMEDOUT)
+            ;
+    }
+    pthread_mutex_unlock(&_history_mutex);
+
+    return NULL;
+}
+
+static void _history_start(void)
+{
+    pthread_condattr_t attr;
+
+    if (!_history_keep_days)
+        return;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_history_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    _history_running = 1;
+    if (pthread_create(&_history_thread, NULL, _history_keeper, NULL))
+        _history_running = 0;
+}
+
+static void _history_stop(void)
+{
+    if (_history_running) {
+        pthread_mutex_lock(&_history_mutex);
+        _history_running = 0;
+        pthread_cond_signal(&_history_cond);
+        pthread_mutex_unlock(&_history_mutex);
+        pthread_join(_history_thread, NULL);
+    }
+    pthread_mutex_lock(&_history_mutex);
+    if (_history_fd >= 0) {
+        close(_history_fd);
+        _history_fd = -1;
+    }
+    pthread_mutex_unlock(&_history_mutex);
+}
+
+/* Agent mode: answer SNMP requests for the relay subtree on a local
+ * address so other managers go through this mount rather than at the
+ * device.  GETs are served from the snapshot where it's fresh, SETs go
+ * down the same session as writes to the relay files. */
+
+static void * _agent_sess = NULL;
+static pthread_t _agent_thread;
+static int _agent_running = 0;
+
+/* First relay whose oid sorts after name, for GETNEXT walks. */
+static int _relay_after_oid(const oid * name, size_t len)
+{
+    unsigned int i;
+    for (i = 0; i < _num_relays; i++)
+        if (snmp_oid_compare(name, len, _oids[i].id, _oids[i].len) < 0)
+            return i;
+    return -1;
+}
+
+static void _agent_error(struct snmp_pdu * reply, struct variable_list * v, int index, int v1err, int v2type)
+{
+    if (reply->version == SNMP_VERSION_1 || !v2type) {
+        if (reply->errstat == SNMP_ERR_NOERROR) {
+            reply->errstat = v1err;
+            reply->errindex = index;
+        }
+    } else {
+        snmp_set_var_typed_value(v, v2type, NULL, 0);
+    }
+}
+
+static void _agent_respond(struct snmp_pdu * pdu, struct snmp_pdu * reply)
+{
+    relay_state states[MAX_RELAYS];
+    struct variable_list * v;
+    int have_all = 0;
+    int index = 0;
+
+    for (v = reply->variables; v; v = v->next_variable) {
+        int relay;
+        long val;
+
+        index++;
+        switch (pdu->command) {
+        case SNMP_MSG_GETNEXT:
+            relay = _relay_after_oid(v->name, v->name_length);
+            if (relay < 0) {
+                _agent_error(reply, v, index, SNMP_ERR_NOSUCHNAME, SNMP_ENDOFMIBVIEW);
+                continue;
+            }
+            snmp_set_var_objid(v, _oids[relay].id, _oids[relay].len);
+            break;
+
+        case SNMP_MSG_GET:
+            relay = _relay_from_oid(v->name, v->name_length);
+            if (relay < 0) {
+                _agent_error(reply, v, index, SNMP_ERR_NOSUCHNAME, SNMP_NOSUCHOBJECT);
+                continue;
+            }
+            break;
+
+        case SNMP_MSG_SET:
+            relay = _relay_from_oid(v->name, v->name_length);
+            if (relay < 0) {
+                _agent_error(reply, v, index, SNMP_ERR_NOSUCHNAME, 0);
+                continue;
+            }
+            if (v->type != ASN_INTEGER || (*v->val.integer != 0 && *v->val.integer != 1)) {
+                _agent_error(reply, v, index, SNMP_ERR_BADVALUE, 0);
+                continue;
+            }
+            if (_command("agent", relay, *v->val.integer ? relay_on : relay_off))
+                _agent_error(reply, v, index, SNMP_ERR_GENERR, 0);
+            continue;
+
+        default:
+            _agent_error(reply, v, index, SNMP_ERR_GENERR, 0);
+            continue;
+        }
+
+        /* One device request covers every relay a GET asks for */
+        if (!_snapshot_load(relay, &states[relay])) {
+            if (!have_all) {
+                have_all = !_get_all(states);
+                if (!have_all) {
+                    _agent_error(reply, v, index, SNMP_ERR_GENERR, 0);
+                    continue;
+                }
+            }
+        }
+        val = states[relay] == relay_on ? 1 : 0;
+        snmp_set_var_typed_value(v, ASN_INTEGER, &val, sizeof(val));
+    }
+}
+
+static int _agent_callback(int op, struct snmp_session * session, int reqid,
+                           struct snmp_pdu * pdu, void * magic)
+{
+    struct snmp_pdu * reply;
+
+    if (op != NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE)
+        return 1;
+
+    if (pdu->command != SNMP_MSG_GET && pdu->command != SNMP_MSG_GETNEXT
+            && pdu->command != SNMP_MSG_SET)
+        return 1;
+
+    if (pdu->community_len != strlen(_community)
+            || memcmp(pdu->community, _community, pdu->community_len))
+        return 1;   // silently dropped, as an agent does with a bad community
+
+    reply = snmp_clone_pdu(pdu);
+    if (!reply)
+        return 1;
+    reply->command = SNMP_MSG_RESPONSE;
+    reply->errstat = SNMP_ERR_NOERROR;
+    reply->errindex = 0;
+
+    _agent_respond(pdu, reply);
+
+    if (!snmp_sess_send(_agent_sess, reply))
+        snmp_free_pdu(reply);
+
+    return 1;
+}
+
+static void * _agent(void * arg)
+{
+    while (_agent_running) {
+        fd_set fds;
+        int nfds = 0, block = 0;
+        struct timeval tv = { 0, 500000 };
+
+        FD_ZERO(&fds);
+        snmp_sess_select_info(_agent_sess, &nfds, &fds, &tv, &block);
+        tv.tv_sec = 0;
+        tv.tv_usec = 500000;    // keep checking whether we've been stopped
+        if (select(nfds, &fds, NULL, NULL, &tv) > 0)
+            snmp_sess_read(_agent_sess, &fds);
+    }
+    return NULL;
+}
+
+static int _agent_start(void)
+{
+    struct snmp_session sess;
+    netsnmp_transport * transport;
+
+    transport = netsnmp_tdomain_transport(_agent_addr, 1, "udp");
+    if (!transport)
+        return 0;
+
+    snmp_sess_init(&sess);
+    sess.version = SNMP_DEFAULT_VERSION;
+    sess.isAuthoritative = SNMP_SESS_AUTHORITATIVE;
+    sess.callback = _agent_callback;
+    _agent_sess = snmp_sess_add(&sess, transport, NULL, NULL);
+    if (!_agent_sess)
+        return 0;
+
+    _agent_running = 1;
+    if (pthread_create(&_agent_thread, NULL, _agent, NULL)) {
+        _agent_running = 0;
+        snmp_sess_close(_agent_sess);
+        _agent_sess = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+static void _agent_stop(void)
+{
+    if (_agent_running) {
+        _agent_running = 0;
+        pthread_join(_agent_thread, NULL);
+    }
+    if (_agent_sess) {
+        snmp_sess_close(_agent_sess);
+        _agent_sess = NULL;
+    }
+}
+
+
+/* Export: serve the snapshot and its changes to other dkrfs mounts
+ * (see remote.c) over TCP.  The protocol is lines of text; bitmaps are
+ * hex with bit 0 for r1.
+ *
+ *   server: DKRFS 2 <num_relays>          on connecting
+ *   client: AUTH <community>               first, or it's disconnected
+ *   client: SUB                            subscribe to changes
+ *   server: S <bits> <known>               current state, then
+ *           D <bits> <changed>             whenever relays change
+ *   client: GET <tag>
+ *   server: V <tag> <bits> <mask> | ERR <tag>
+ *   client: SET <tag> <relay> <0|1>        relay numbered from 1
+ *   server: OK <tag> | ERR <tag>
+ */
+
+#define EXPORT_MAX_LINE 128
+#define EXPORT_QUEUE    8192    // how far a client may fall behind before it's dropped
+
+/* Lines for a client are queued and sent by its writer thread, so that
+ * nobody changing a relay waits on a slow subscriber. */
+struct export_client {
+    int fd;
+    int authenticated;
+    int subscribed;
+    int closing;
+    pthread_t writer;
+    pthread_mutex_t wmutex;
+    pthread_cond_t wcond;
+    size_t len;
+    char out[EXPORT_QUEUE];
+    struct export_client * next;
+};
+
+static int _export_fd = -1;
+static pthread_t _export_thread;
+static struct export_client * _export_clients = NULL;
+static int _export_nclients = 0;
+static pthread_mutex_t _export_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _export_cond = PTHREAD_COND_INITIALIZER;
+
+static void _export_send(struct export_client * c, const char * fmt, ...)
+{
+    char line[EXPORT_MAX_LINE];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    if (n >= (int)sizeof(line))
+        n = sizeof(line) - 1;
+
+    pthread_mutex_lock(&c->wmutex);
+    if (!c->closing && c->len + n > sizeof(c->out)) {
+        c->closing = 1;
+        shutdown(c->fd, SHUT_RDWR);     // too slow, its reader cleans up
+    } else if (!c->closing) {
+        memcpy(c->out + c->len, line, n);
+        c->len += n;
+    }
+    pthread_cond_signal(&c->wcond);
+    pthread_mutex_unlock(&c->wmutex);
+}
+
+static void * _export_writer(void * arg)
+{
+    struct export_client * c = arg;
+    char buf[EXPORT_QUEUE];
+    size_t n;
+
+    pthread_mutex_lock(&c->wmutex);
+    for (;;) {
+        while (!c->len && !c->closing)
+            pthread_cond_wait(&c->wcond, &c->wmutex);
+        if (c->closing)
+            break;
+        n = c->len;
+        memcpy(buf, c->out, n);
+        c->len = 0;
+        pthread_mutex_unlock(&c->wmutex);
+
+        if (send(c->fd, buf, n, MSG_NOSIGNAL) != (ssize_t)n)
+            shutdown(c->fd, SHUT_RDWR);     // gone, its reader cleans up
+
+        pthread_mutex_lock(&c->wmutex);
+    }
+    pthread_mutex_unlock(&c->wmutex);
+
+    return NULL;
+}
+
+/* Called with the snapshot locked */
+static void _export_changed(uint32_t mask, uint32_t bits)
+{
+    struct export_client * c;
+
+    pthread_mutex_lock(&_export_mutex);
+    for (c = _export_clients; c; c = c->next)
+        if (c->subscribed)
+            _export_send(c, "D %x %x\n", bits & mask, mask);
+    pthread_mutex_unlock(&_export_mutex);
+}
+
+static void _export_command(struct export_client * c, char * line)
+{
+    unsigned int tag, relay, val;
+    relay_state states[MAX_RELAYS];
+    uint32_t all = (1u << _num_relays) - 1;
+
+    if (!c->authenticated) {
+        // the same community the device needs, so the export is no way round it
+        if (strncmp(line, "AUTH ", 5) || strcmp(line + 5, _community))
+            shutdown(c->fd, SHUT_RDWR);
+        else
+            c->authenticated = 1;
+    } else if (!strcmp(line, "SUB")) {
+        // the snapshot before the export list, as when changes are queued
+        _snapshot_lock();
+        pthread_mutex_lock(&_export_mutex);
+        _export_send(c, "S %x %x\n", _snapshot->bits & _snapshot->known & all, _snapshot->known & all);
+        c->subscribed = 1;
+        pthread_mutex_unlock(&_export_mutex);
+        _snapshot_unlock();
+    } else if (sscanf(line, "GET %u", &tag) == 1) {
+        unsigned int i;
+        for (i = 0; i < _num_relays; i++)
+            if (!_snapshot_load(i, &states[i]))
+                break;
+        if (i < _num_relays && _get_all(states)) {
+            _export_send(c, "ERR %u\n", tag);
+            return;
+        }
+        _export_send(c, "V %u %x %x\n", tag, dkrfs_bits(states, _num_relays), all);
+    } else if (sscanf(line, "SET %u %u %u", &tag, &relay, &val) == 3) {
+        if (relay >= 1 && relay <= _num_relays && val <= 1
+                && !_command("export", relay - 1, val ? relay_on : relay_off))
+            _export_send(c, "OK %u\n", tag);
+        else
+            _export_send(c, "ERR %u\n", tag);
+    }
+}
+
+static void * _export_client(void * arg)
+{
+    struct export_client * c = arg, ** pc;
+    char buf[EXPORT_MAX_LINE];
+    size_t len = 0;
+    ssize_t n;
+
+    _export_send(c, "DKRFS 2 %u\n", _num_relays);
+
+    while ((n = recv(c->fd, buf + len, sizeof(buf) - len - 1, 0)) > 0) {
+        char * line, * nl;
+        len += n;
+        buf[len] = '\0';
+        for (line = buf; (nl = strchr(line, '\n')); line = nl + 1) {
+            *nl = '\0';
+            if (nl > line && nl[-1] == '\r')
+                nl[-1] = '\0';
+            _export_command(c, line);
+        }
+        len -= line - buf;
+        if (len == sizeof(buf) - 1)
+            break;      // no newline in a full buffer, not one of ours
+        memmove(buf, line, len);
+    }
+
+    pthread_mutex_lock(&c->wmutex);
+    c->closing = 1;
+    pthread_cond_signal(&c->wcond);
+    pthread_mutex_unlock(&c->wmutex);
+    pthread_join(c->writer, NULL);
+
+    pthread_mutex_lock(&_export_mutex);
+    for (pc = &_export_clients; *pc != c; pc = &(*pc)->next)
+        ;
+    *pc = c->next;
+    _export_nclients--;
+    pthread_cond_signal(&_export_cond);
+    pthread_mutex_unlock(&_export_mutex);
+
+    close(c->fd);
+    pthread_cond_destroy(&c->wcond);
+    pthread_mutex_destroy(&c->wmutex);
+    free(c);
+    return NULL;
+}
+
+static void * _export(void * arg)
+{
+    int fd;
+
+    while ((fd = accept(_export_fd, NULL, NULL)) >= 0) {
+        struct timeval tv = { 1, 0 };
+        struct export_client * c = calloc(1, sizeof(*c));
+        pthread_t thread;
+        pthread_attr_t attr;
+
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        c->fd = fd;
+        pthread_mutex_init(&c->wmutex, NULL);
+        pthread_cond_init(&c->wcond, NULL);
+        if (pthread_create(&c->writer, NULL, _export_writer, c)) {
+            pthread_cond_destroy(&c->wcond);
+            pthread_mutex_destroy(&c->wmutex);
+            free(c);
+            close(fd);
+            continue;
+        }
+
+        pthread_mutex_lock(&_export_mutex);
+        c->next = _export_clients;
+        _export_clients = c;
+        _export_nclients++;
+        pthread_mutex_unlock(&_export_mutex);
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, _export_client, c))
+            shutdown(fd, SHUT_RDWR);
+        pthread_attr_destroy(&attr);
+    }
+    return NULL;
+}
+
+/* ADDR is [host:]port */
+static int _export_start(void)
+{
+    struct addrinfo hints, * res, * ai;
+    char * addr = strdup(_export_addr);
+    char * port = strrchr(addr, ':');
+    const char * host = "127.0.0.1";    // unless told where to listen
+    int one = 1;
+
+    if (port) {
+        *port++ = '\0';
+        host = addr;
+    } else
+        port = addr;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host, port, &hints, &res)) {
+        free(addr);
+        return 0;
+    }
+    free(addr);
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        _export_fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (_export_fd < 0)
+            continue;
+        setsockopt(_export_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (!bind(_export_fd, ai->ai_addr, ai->ai_addrlen) && !listen(_export_fd, 16))
+            break;
+        close(_export_fd);
+        _export_fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (_export_fd < 0)
+        return 0;
+
+    if (pthread_create(&_export_thread, NULL, _export, NULL)) {
+        close(_export_fd);
+        _export_fd = -1;
+        return 0;
+    }
+    return 1;
+}
+
+static void _export_stop(void)
+{
+    struct export_client * c;
+
+    if (_export_fd < 0)
+        return;
+
+    shutdown(_export_fd, SHUT_RDWR);
+    pthread_join(_export_thread, NULL);
+    close(_export_fd);
+    _export_fd = -1;
+
+    pthread_mutex_lock(&_export_mutex);
+    for (c = _export_clients; c; c = c->next)
+        shutdown(c->fd, SHUT_RDWR);
+    while (_export_nclients)
+        pthread_cond_wait(&_export_cond, &_export_mutex);
+    pthread_mutex_unlock(&_export_mutex);
+}
+
+/* Control files: hidden files in the root whose content is made up on
+ * each read, for looking inside the daemon. */
+
+#define SPECIAL_MAX 4096
+
+static int _stats_render(char * buf, size_t size)
+{
+    int n, i;
+    uint64_t now = _now_ms();
+    struct timespec real;
+
+    _now_real(&real);
+
+    _snapshot_lock();
+    n = snprintf(buf, size,
+                 "device %s\n"
+                 "backend %s\n"
+                 "uptime %ld\n"
+                 "poll_ms %u\n"
+                 "leader %d\n"
+                 "snapshot_age_ms %lld\n",
+                 _peername, _backend->name, (long)(real.tv_sec - _start_time), _poll_ms, _leader,
+                 _snapshot->updated ? (long long)(now - _snapshot->updated) : -1LL);
+    _snapshot_unlock();
+
+    n += snprintf(buf + n, size - n,
+                  "reads %llu\n"
+                  "writes %llu\n"
+                  "read_errors %llu\n"
+                  "write_errors %llu\n"
+                  "cache_hits %llu\n"
+                  "cache_misses %llu\n"
+                  "requests %llu\n"
+                  "request_errors %llu\n"
+                  "retries %llu\n"
+                  "prefetches %llu\n"
+                  "board_prefetches %llu\n"
+                  "prefetch_hits %llu\n"
+                  "queue_max %u\n"
+                  "overload %s\n"
+                  "rejected %llu\n"
+                  "stale_served %llu\n"
+                  "blocked %llu\n"
+                  "limit %s%u\n"
+                  "rtt_min_us %llu\n"
+                  "limit_decreases %llu\n"
+                  "stale_replies %llu\n"
+                  "audit_entries %llu\n"
+                  "audit_commits %llu\n"
+                  "sessions_opened %llu\n"
+                  "sessions_reaped %llu\n"
+                  "fleet_sweeps %llu\n"
+                  "fleet_coalesced %llu\n"
+                  "inflight %u\n"
+                  "inflight_max %u\n"
+                  "rtt_us",
+                  (unsigned long long)_stats.reads, (unsigned long long)_stats.writes,
+                  (unsigned long long)_stats.read_errors, (unsigned long long)_stats.write_errors,
+                  (unsigned long long)_stats.cache_hits, (unsigned long long)_stats.cache_misses,
+                  (unsigned long long)_stats.requests, (unsigned long long)_stats.request_errors,
+                  (unsigned long long)_stats.retries,
+                  (unsigned long long)_stats.prefetches, (unsigned long long)_stats.board_prefetches,
+                  (unsigned long long)_stats.prefetch_hits,
+                  _queue_max, _overload_names[_overload],
+                  (unsigned long long)_stats.rejected, (unsigned long long)_stats.stale_served,
+                  (unsigned long long)_stats.blocked,
+                  _limit_adaptive ? "adaptive " : "", _limit_adaptive ? (unsigned int)_window : _limit,
+                  (unsigned long long)_rtt_min, (unsigned long long)_stats.limit_decreases,
+                  (unsigned long long)_stats.stale_replies,
+                  (unsigned long long)_stats.audit_entries, (unsigned long long)_stats.audit_commits,
+                  (unsigned long long)_stats.sessions_opened, (unsigned long long)_stats.sessions_reaped,
+                  (unsigned long long)_stats.fleet_sweeps, (unsigned long long)_stats.fleet_coalesced,
+                  _stats.inflight, _stats.inflight_max);
+    for (i = 0; i < RTT_BUCKETS && n < (int)size; i++)
+        n += snprintf(buf + n, size - n, " %llu", (unsigned long long)_stats.rtt[i]);
+    if (n < (int)size)
+        n += snprintf(buf + n, size - n, "\n");
+    for (i = 0; _perf && i < PERF_OPS && n < (int)size; i++)
+        n += snprintf(buf + n, size - n, "perf_%s %llu %llu %llu %llu %llu\n", _perf_op_names[i],
+                      (unsigned long long)_perf_totals[i].count,
+                      (unsigned long long)_perf_totals[i].total[PERF_CYCLES],
+                      (unsigned long long)_perf_totals[i].total[PERF_INSTRUCTIONS],
+                      (unsigned long long)_perf_totals[i].total[PERF_CACHE_MISSES],
+                      (unsigned long long)_perf_totals[i].total[PERF_CONTEXT_SWITCHES]);
+
+    return n < (int)size ? n : (int)size - 1;
+}
+
+/* The device's generation, then each relay's version: the generation at
+ * which it last changed.  Re-reading the first line is enough to tell
+ * whether anything has changed since. */
+static int _generation_render(char * buf, size_t size)
+{
+    uint64_t version[MAX_RELAYS], generation;
+    unsigned int i;
+    int n;
+
+    _snapshot_lock();
+    generation = _snapshot->generation;
+    memcpy(version, _snapshot->version, sizeof(version));
+    _snapshot_unlock();
+
+    n = snprintf(buf, size, "%llu\n", (unsigned long long)generation);
+    for (i = 0; i < _num_relays && n < (int)size; i++)
+        n += snprintf(buf + n, size - n, "r%u %llu\n", i + 1, (unsigned long long)version[i]);
+
+    return n < (int)size ? n : (int)size - 1;
+}
+
+/* Requests waiting for a place at the device or a connection to it, and
+ * those sent to it, oldest first: whether it's been sent, for how long
+ * it's been waiting or at the device, what it is, the relays it's about,
+ * the process it's for, and how many times it's been resent.  Many queued
+ * means too many callers, a few sent and getting old a slow device. */
+static int _queue_render(char * buf, size_t size)
+{
+    unsigned int queued = 0, sent = 0;
+    struct request * rq;
+    uint64_t now;
+    int n;
+
+    pthread_mutex_lock(&_requests.mutex);
+    now = _now_us();
+    for (rq = _requests.head; rq; rq = rq->next)
+        if (__atomic_load_n(&rq->sent_us, __ATOMIC_RELAXED))
+            sent++;
+        else
+            queued++;
+    n = snprintf(buf, size, "device %s\nqueued %u\nsent %u\nstate age_us type relays pid retries\n",
+                 _peername, queued, sent);
+    for (rq = _requests.head; rq && n < (int)size; rq = rq->next) {
+        uint64_t sent_us = __atomic_load_n(&rq->sent_us, __ATOMIC_RELAXED);
+        uint64_t since = sent_us ? sent_us : rq->queued_us;
+        char relays[16], pid[16];
+
+        if (rq->mask && !(rq->mask & (rq->mask - 1)))
+            snprintf(relays, sizeof(relays), "r%d", __builtin_ctz(rq->mask) + 1);
+        else
+            snprintf(relays, sizeof(relays), "0x%x", rq->mask);
+        if (rq->pid)
+            snprintf(pid, sizeof(pid), "%d", (int)rq->pid);
+        else
+            strcpy(pid, "-");
+        n += snprintf(buf + n, size - n, "%s %llu %s %s %s %u\n",
+                      sent_us ? "sent" : "queued", now > since ? (unsigned long long)(now - since) : 0ULL,
+                      _request_types[rq->type], relays, pid,
+                      __atomic_load_n(&rq->retries, __ATOMIC_RELAXED));
+    }
+    pthread_mutex_unlock(&_requests.mutex);
+
+    return n < (int)size ? n : (int)size - 1;
+}
+
+/* Every board in the fleet, swept now or by the sweep already under way:
+ * name, ok, error or timeout, microseconds to the answer, and its relays
+ * as in .board. */
+static int _fleet_render(char * buf, size_t size)
+{
+    static const char * status[] = { "ok", "error", "timeout" };
+    unsigned int i, answered = 0;
+    uint64_t sweeps;
+    int n;
+
+    pthread_mutex_lock(&_fleet.mutex);
+    if (_fleet.sweeping) {
+        STAT_INC(fleet_coalesced);
+        sweeps = _fleet.sweeps;
+        while (_fleet.sweeps == sweeps)
+            pthread_cond_wait(&_fleet.cond, &_fleet.mutex);
+    } else {
+        uint64_t elapsed;
+
+        _fleet.sweeping = 1;
+        pthread_mutex_unlock(&_fleet.mutex);
+        elapsed = _fleet_sweep();
+        pthread_mutex_lock(&_fleet.mutex);
+        for (i = 0; i < _fleet.count; i++)
+            _fleet.boards[i].shown = _fleet.boards[i].sweep;
+        _fleet.elapsed_us = elapsed;
+        _fleet.sweeping = 0;
+        _fleet.sweeps++;
+        STAT_INC(fleet_sweeps);
+        pthread_cond_broadcast(&_fleet.cond);
+    }
+
+    for (i = 0; i < _fleet.count; i++)
+        if (_fleet.boards[i].shown.status == CAPTURE_OK)
+            answered++;
+    n = snprintf(buf, size, "boards %u\nanswered %u\nelapsed_us %llu\nname status rtt_us relays\n",
+                 _fleet.count, answered, (unsigned long long)_fleet.elapsed_us);
+    for (i = 0; i < _fleet.count && n < (int)size; i++) {
+        const struct fleet_result * b = &_fleet.boards[i].shown;
+        const char * name = _fleet.boards[i].name;
+        char relays[MAX_RELAYS + 1];
+        unsigned int j;
+
+        for (j = 0; j < _num_relays; j++)
+            relays[j] = b->bits & (1u << j) ? '1' : '0';
+        relays[j] = '\0';
+        if (b->status == CAPTURE_TIMEOUT || !b->rtt_us)
+            n += snprintf(buf + n, size - n, "%s %s - -\n", name, status[b->status]);
+        else
+            n += snprintf(buf + n, size - n, "%s %s %llu %s\n", name, status[b->status],
+                          (unsigned long long)b->rtt_us, b->status == CAPTURE_OK ? relays : "-");
+    }
+    pthread_mutex_unlock(&_fleet.mutex);
+
+    return n < (int)size ? n : (int)size - 1;
+}
+
+/* The whole board, one 0 or 1 per relay as in the relay files, in a
+ * single request.  Empty if the device couldn't be asked. */
+static int _board_render(char * buf, size_t size)
+{
+    relay_state s[MAX_RELAYS];
+    unsigned int i;
+    int err;
+
+    if ((err = _get_all(s)))
+        return err;
+    if (size < _num_relays + 2)
+        return 0;
+    for (i = 0; i < _num_relays; i++)
+        buf[i] = s[i] == relay_on ? '1' : '0';
+    buf[i++] = '\n';
+    buf[i] = '\0';
+    return i;
+}
+
+/* Log each relay set by an ioctl, then wait once for all of them */
+static int _board_audit(uint32_t mask, uint32_t bits, int err)
+{
+    struct fuse_context * ctx = _context();
+    uint64_t seq = 0;
+    unsigned int i;
+    char who[48];
+    int audit_err = 0;
+
+    if (_audit_fd < 0)
+        return 0;
+    snprintf(who, sizeof(who), "pid %d uid %d", ctx ? ctx->pid : 0, ctx ? (int)ctx->uid : 0);
+    for (i = 0; i < _num_relays && !audit_err; i++)
+        if (mask & (1u << i))
+            audit_err = _audit_queue(who, i, bits & (1u << i) ? relay_on : relay_off, err, &seq);
+    return audit_err ? audit_err : _audit_wait(seq);
+}
+
+/* See dkrfs_ioctl.h */
+static int _board_ioctl(unsigned int cmd, void * data, int writable)
+{
+    uint32_t all = (1u << _num_relays) - 1;
+    relay_state s[MAX_RELAYS];
+    int err;
+
+    switch (cmd) {
+    case DKRFS_IOC_GET: {
+        struct dkrfs_board * b = data;
+        if ((err = _get_all(s)))
+            return err;
+        b->num_relays = _num_relays;
+        b->bits = dkrfs_bits(s, _num_relays);
+        return 0;
+    }
+
+    case DKRFS_IOC_SET: {
+        struct dkrfs_set * set = data;
+        if (!writable)
+            return -EBADF;
+        if (set->mask & ~all)
+            return -EINVAL;
+        err = _set_mask(set->mask, set->bits);
+        if (_board_audit(set->mask, set->bits, err))
+            return -EIO;
+        return err;
+    }
+
+    case DKRFS_IOC_CAS: {
+        struct dkrfs_cas * cas = data;
+        if (!writable)
+            return -EBADF;
+        if (cas->mask & ~all)
+            return -EINVAL;
+        err = _cas_mask(cas->mask, cas->expect, cas->bits, &cas->found);
+        if (err != 0 && _board_audit(cas->mask, cas->bits, err < 0 ? err : 0))
+            return -EIO;
+        return err;
+    }
+    }
+
+    return -ENOTTY;
+}
+
+/* Files beside the relays'.  Those with an ioctl may be opened for writing
+ * to use it; writes themselves fail. */
+static const struct special {
+    const char * path;
+    int (*render)(char * buf, size_t size);  // length, or -errno for the reader
+    int (*ioctl)(unsigned int cmd, void * data, int writable);
+} _specials[] = {
+    { "/.stats", _stats_render, NULL },
+    { "/.generation", _generation_render, NULL },
+    { "/.queue", _queue_render, NULL },
+    { "/.fleet", _fleet_render, NULL },
+    { "/.board", _board_render, _board_ioctl },
+    { NULL, NULL, NULL }
+};
+
+static const struct special * _special_from_path(const char * path)
+{
+    const struct special * sp;
+    for (sp = _specials; sp->path; sp++)
+        if (!strcmp(path, sp->path))
+            return sp;
+    return NULL;
+}
+
+/* A special file's content, rendered at its first read after it's opened
+ * and kept until it's released, so every read through one open sees the
+ * same snapshot and a cat renders it once. */
+struct special_file {
+    int len;                    // -1 until rendered
+    int writable;               // opened for writing, for its ioctl
+    char content[SPECIAL_MAX];
+};
+
+static int _special_read(const struct special * sp, struct fuse_file_info * fi,
+                         char * buf, size_t size, off_t offset)
+{
+    struct special_file * f = fi ? (struct special_file *)(uintptr_t)fi->fh : NULL;
+    char content[SPECIAL_MAX];
+    const char * p = content;
+    int len;
+
+    if (f) {
+        if (f->len < 0) {
+            if ((len = sp->render(f->content, sizeof(f->content))) < 0)
+                return len;     // not kept, so the next read tries again
+            f->len = len;
+        }
+        len = f->len;
+        p = f->content;
+    } else if ((len = sp->render(content, sizeof(content))) < 0)
+        return len;
+
+    if (offset >= len)
+        return 0;
+    if (size > len - offset)
+        size = len - offset;
+    memcpy(buf, p + offset, size);
+    return size;
+}
+
+static int _getattr(const char *path, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+
+    if (!strcmp(path, "/")) {
+        stbuf->st_mode = S_IFDIR | 0775;
+        stbuf->st_nlink = 2;
+        stbuf->st_ctime = _start_time;
+        stbuf->st_mtime = _start_time;
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+        return 0;
+    }
+
+    int channel = _relay_from_path(path);
+    if (channel >= 0) {
+        stbuf->st_mode = S_IFREG | 0664;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = 1;
+        stbuf->st_mtim = _snapshot_changed(channel);
+        stbuf->st_ctim = stbuf->st_mtim;
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+        return 0;
+    }
+
+    const struct special * sp = _special_from_path(path);
+    if (sp) {
+        stbuf->st_mode = S_IFREG | (sp->ioctl ? 0664 : 0444);
+        stbuf->st_nlink = 1;
+        stbuf->st_ctime = _start_time;
+        stbuf->st_mtime = time(NULL);
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+        return 0;
+    }
+
+    return -ENOENT;
+}
+
+static int _readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi)
+{
+    if(strcmp(path, "/") != 0)
+        return -ENOENT;
+
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+
+    int i;
+    for (i = 0; i < _num_relays; i++) {
+        char fnam[16];
+        sprintf(fnam, "r%d", i + 1);
+        filler(buf, fnam, NULL, 0);
+    }
+
+    return 0;
+}
+
+static int _open(const char *path, struct fuse_file_info *fi)
+{
+    const struct special * sp = _special_from_path(path);
+    if (sp) {
+        struct special_file * f;
+        if ((fi->flags & O_ACCMODE) != O_RDONLY && !sp->ioctl)
+            return -EACCES;
+        if (!(f = malloc(sizeof(*f))))
+            return -ENOMEM;
+        f->len = -1;
+        f->writable = (fi->flags & O_ACCMODE) != O_RDONLY;
+        fi->fh = (uintptr_t)f;
+        fi->direct_io = 1;      // size is unknown until it's read
+        return 0;
+    }
+
+    int channel = _relay_from_path(path);
+    if (channel < 0)
+        return -ENOENT;
+
+    fi->fh = 0;
+    if (_prefetch_running && (fi->flags & O_ACCMODE) != O_WRONLY)
+        fi->fh = _prefetch_open(channel);
+    return 0;
 }
 
 static int _read(const char *path, char *buf, size_t size, off_t offset,
@@ -176,19 +3327,26 @@ static int _read(const char *path, char *buf, size_t size, off_t offset,
 {
     int channel = _relay_from_path(path);
 
-    if (channel < 0)
-        return -ENOENT;
+    if (channel < 0) {
+        const struct special * sp = _special_from_path(path);
+        return sp ? _special_read(sp, fi, buf, size, offset) : -ENOENT;
+    }
 
     if (!size || offset)
         return 0;
 
+    STAT_INC(reads);
+    struct perf_sample ps;
     relay_state s;
-    if (_get_relay(channel, &s)) {
+    int err = 0;
+    _perf_begin(&ps);
+    if ((fi && fi->fh && _prefetch_read(channel, fi->fh, &s)) || !(err = _get_relay(channel, &s)))
         *buf = s == relay_on ? '1' : '0';
-        return 1;
-    }
+    else
+        STAT_INC(read_errors);
+    _perf_end(PERF_READ, &ps);
 
-    return -EIO;
+    return err ? err : 1;
 }
 
 static int _write(const char *path, const char *buf, size_t size, off_t offset,
@@ -197,23 +3355,81 @@ static int _write(const char *path, const char *buf, size_t size, off_t offset,
     int channel = _relay_from_path(path);
 
     if (channel < 0)
-        return -ENOENT;
+        return _special_from_path(path) ? -EINVAL : -ENOENT;
 
     if (!size || offset)
         return 0;
 
-    _set_relay(channel, *buf == '1' ? relay_on : relay_off);
+    STAT_INC(writes);
+    struct perf_sample ps;
+    _perf_begin(&ps);
+    int err = _set_relay(channel, *buf == '1' ? relay_on : relay_off);
+    int ret = err == -EBUSY ? err : (int)size;
+    if (err)
+        STAT_INC(write_errors);
 
-    return size;
+    if (_audit_fd >= 0) {
+        struct fuse_context * ctx = _context();
+        char who[48];
+        snprintf(who, sizeof(who), "pid %d uid %d", ctx ? ctx->pid : 0, ctx ? (int)ctx->uid : 0);
+        if (_audit(who, channel, *buf == '1' ? relay_on : relay_off, err))
+            ret = -EIO;
+    }
+    _perf_end(PERF_WRITE, &ps);
+
+    return ret;
+}
+
+static int _ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                  unsigned int flags, void *data)
+{
+    const struct special * sp = _special_from_path(path);
+    struct special_file * f = fi ? (struct special_file *)(uintptr_t)fi->fh : NULL;
+
+    // fuse only passes fh with an ioctl, not the flags it was opened with
+    if (!sp || !sp->ioctl)
+        return -ENOTTY;
+    return sp->ioctl(cmd, data, f && f->writable);
 }
 
 static void _destroy(void * nuttin)
 {
-    snmp_close(_snmp_session);
+    if (_polling) {
+        pthread_mutex_lock(&_poll_mutex);
+        _polling = 0;
+        pthread_cond_signal(&_poll_cond);
+        pthread_mutex_unlock(&_poll_mutex);
+        pthread_join(_poll_thread, NULL);
+    }
+    _prefetch_stop();
+    _agent_stop();
+    _export_stop();
+    _audit_stop();
+    _history_stop();
+    _shared_close();
+    _backend->close();
+    if (_trace_file)
+        fclose(_trace_file);
     free(_community);
     free(_peername);
+    free(_lockdir);
+    free(_agent_addr);
+    free(_export_addr);
+    free(_record_path);
+    free(_trace_path);
+    free(_audit_path);
+    free(_history_dir);
+    free(_fleet_path);
+    free(_fleet.boards);
 }
  
+static int _release(const char * path, struct fuse_file_info * fi)
+{
+    if (_special_from_path(path))
+        free((struct special_file *)(uintptr_t)fi->fh);
+    return 0;
+}
+
 static int _chmod(const char * path, mode_t mode)
 {
     return 0;
@@ -240,6 +3456,8 @@ static struct fuse_operations _oper = {
     .open = _open,
     .write = _write,
     .read = _read,
+    .release = _release,
+    .ioctl = _ioctl,
     .init = _init,
     .destroy = _destroy,
     .chmod = _chmod,
@@ -248,8 +3466,503 @@ static struct fuse_operations _oper = {
     .truncate = _truncate,
 };
 
+/* Tracing: the same operations wrapped to log each call to the trace
+ * file, for replaying the workload later with dkrfs-replay. */
+
+static int _trace(int op, const char * path, size_t size, off_t offset, int flags,
+                  const char * data, uint64_t start, int result)
+{
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct trace_record r;
+
+    memset(&r, 0, sizeof(r));
+    r.start_us = start - _trace_start;
+    r.duration_us = _now_us() - start;
+    r.pid = fuse_get_context()->pid;
+    r.result = result;
+    r.size = size;
+    r.offset = offset;
+    r.flags = flags;
+    r.op = op;
+    if (data)
+        memcpy(r.data, data, size < sizeof(r.data) ? size : sizeof(r.data));
+    strncpy(r.path, path, sizeof(r.path) - 1);
+
+    pthread_mutex_lock(&mutex);
+    fwrite(&r, sizeof(r), 1, _trace_file);
+    pthread_mutex_unlock(&mutex);
+
+    return result;
+}
+
+static int _t_getattr(const char *path, struct stat *stbuf)
+{
+    uint64_t start = _now_us();
+    return _trace(TRACE_GETATTR, path, 0, 0, 0, NULL, start, _getattr(path, stbuf));
+}
+
+static int _t_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                      off_t offset, struct fuse_file_info *fi)
+{
+    uint64_t start = _now_us();
+    return _trace(TRACE_READDIR, path, 0, offset, 0, NULL, start, _readdir(path, buf, filler, offset, fi));
+}
+
+static int _t_open(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t start = _now_us();
+    return _trace(TRACE_OPEN, path, 0, 0, fi->flags, NULL, start, _open(path, fi));
+}
+
+static int _t_read(const char *path, char *buf, size_t size, off_t offset,
+                   struct fuse_file_info *fi)
+{
+    uint64_t start = _now_us();
+    return _trace(TRACE_READ, path, size, offset, 0, NULL, start, _read(path, buf, size, offset, fi));
+}
+
+static int _t_write(const char *path, const char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi)
+{
+    uint64_t start = _now_us();
+    return _trace(TRACE_WRITE, path, size, offset, 0, buf, start, _write(path, buf, size, offset, fi));
+}
+
+static int _t_release(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t start = _now_us();
+    return _trace(TRACE_RELEASE, path, 0, 0, fi->flags, NULL, start, _release(path, fi));
+}
+
+static int _t_chmod(const char * path, mode_t mode)
+{
+    uint64_t start = _now_us();
+    return _trace(TRACE_CHMOD, path, 0, 0, mode, NULL, start, _chmod(path, mode));
+}
+
+static int _t_chown(const char * path, uid_t uid, gid_t gid)
+{
+    uint64_t start = _now_us();
+    return _trace(TRACE_CHOWN, path, 0, 0, 0, NULL, start, _chown(path, uid, gid));
+}
+
+static int _t_utime(const char * path, struct utimbuf * t)
+{
+    uint64_t start = _now_us();
+    return _trace(TRACE_UTIME, path, 0, 0, 0, NULL, start, _utime(path, t));
+}
+
+static int _t_truncate(const char* path, off_t o)
+{
+    uint64_t start = _now_us();
+    return _trace(TRACE_TRUNCATE, path, 0, o, 0, NULL, start, _truncate(path, o));
+}
+
+static int _t_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                    unsigned int flags, void *data)
+{
+    uint64_t start = _now_us();
+    uint32_t mask = 0, bits = 0;
+
+    if ((unsigned int)cmd == DKRFS_IOC_SET) {
+        mask = ((struct dkrfs_set *)data)->mask;
+        bits = ((struct dkrfs_set *)data)->bits & mask;
+    } else if ((unsigned int)cmd == DKRFS_IOC_CAS) {
+        mask = ((struct dkrfs_cas *)data)->mask;
+        bits = (((struct dkrfs_cas *)data)->bits & mask)
+             | (((struct dkrfs_cas *)data)->expect & mask) << 16;
+    }
+    return _trace(TRACE_IOCTL, path, mask, bits, cmd, NULL, start,
+                  _ioctl(path, cmd, arg, fi, flags, data));
+}
+
+static struct fuse_operations _traced_oper = {
+    .getattr = _t_getattr,
+    .readdir = _t_readdir,
+    .open = _t_open,
+    .write = _t_write,
+    .read = _t_read,
+    .release = _t_release,
+    .ioctl = _t_ioctl,
+    .init = _init,
+    .destroy = _destroy,
+    .chmod = _t_chmod,
+    .chown = _t_chown,
+    .utime = _t_utime,
+    .truncate = _t_truncate,
+};
+
+static int _cmp_u64(const void * a, const void * b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Under the virtual clock a run ends with what .stats would show, which
+ * comes out the same for every run of the same capture. */
+static void _print_stats(void)
+{
+    char buf[SPECIAL_MAX];
+
+    if (_virtual_clock) {
+        fwrite(buf, 1, _stats_render(buf, sizeof(buf)), stdout);
+        fflush(stdout);
+    }
+}
+
+/* Time n reads of the whole device through the chosen backend, to help
+ * pick the best one for a board. */
+static int _bench(unsigned int n)
+{
+    uint64_t * lat = malloc(n * sizeof(*lat));
+    uint64_t start, total;
+    unsigned int i, ok = 0;
+
+    if (!lat)
+        return -1;
+    if (_backend->start)
+        _backend->start();
+
+    start = _now_us();
+    for (i = 0; i < n; i++) {
+        relay_state s[MAX_RELAYS];
+        uint64_t t;
+
+        if (_virtual_clock)
+            _run_due();
+        t = _now_us();
+        ok += _backend->get_all(s);
+        lat[i] = _now_us() - t;
+    }
+    total = _now_us() - start;
+
+    qsort(lat, n, sizeof(*lat), _cmp_u64);
+    printf("%s %s: %u/%u ok in %.3fs, %.1f req/s\n"
+           "latency ms: p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+           _backend->name, _peername, ok, n, total / 1e6, n * 1e6 / (total ? total : 1),
+           lat[n / 2] / 1e3, lat[n * 9 / 10] / 1e3, lat[n * 99 / 100] / 1e3, lat[n - 1] / 1e3);
+    _print_stats();
+
+    free(lat);
+    _backend->close();
+    return ok == n ? 0 : 1;
+}
+
+struct heap_sample {
+    size_t in_use;
+    size_t arena;
+    size_t free;
+    long rss_kb;
+};
+
+static void _heap_sample(struct heap_sample * h)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 mi = mallinfo2();
+#else
+    struct mallinfo mi = mallinfo();
+#endif
+    FILE * f = fopen("/proc/self/statm", "r");
+    long pages = 0;
+
+    h->in_use = mi.uordblks + mi.hblkhd;
+    h->arena = mi.arena + mi.hblkhd;
+    h->free = mi.fordblks;
+    if (f) {
+        if (fscanf(f, "%*d %ld", &pages) != 1)
+            pages = 0;
+        fclose(f);
+    }
+    h->rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+#if defined(DKRFS_MICROBENCH) && defined(__GLIBC__)
+/* Allocations are counted by standing in for glibc's malloc family, but
+ * only while a soak or microbenchmark is running, and only in the
+ * dkrfs-microbench build: make microbench.  Those libc makes for
+ * itself, as in strdup or fopen, don't come through here. */
+#define COUNTING_ALLOCS
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t n, size_t size);
+extern void * __libc_realloc(void * p, size_t size);
+extern void * __libc_memalign(size_t alignment, size_t size);
+
+static int _counting_allocs = 0;
+static uint64_t _allocs;
+
+static void _count_alloc(void)
+{
+    if (_counting_allocs)
+        __atomic_add_fetch(&_allocs, 1, __ATOMIC_RELAXED);
+}
+
+void * malloc(size_t size)
+{
+    _count_alloc();
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t n, size_t size)
+{
+    _count_alloc();
+    return __libc_calloc(n, size);
+}
+
+void * realloc(void * p, size_t size)
+{
+    _count_alloc();
+    return __libc_realloc(p, size);
+}
+
+void * memalign(size_t alignment, size_t size)
+{
+    _count_alloc();
+    return __libc_memalign(alignment, size);
+}
+
+void * aligned_alloc(size_t alignment, size_t size)
+{
+    _count_alloc();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void ** p, size_t alignment, size_t size)
+{
+    void * q;
+
+    if (!alignment || alignment % sizeof(void *) || alignment & (alignment - 1))
+        return EINVAL;
+    _count_alloc();
+    if (!(q = __libc_memalign(alignment, size)))
+        return ENOMEM;
+    *p = q;
+    return 0;
+}
+#endif
+
+/* Drive n reads and writes through the file handlers, writes putting
+ * back what was read, watching the heap and RSS.  Fails if the heap
+ * retained after the first tenth grows by more than the budget per
+ * thousand operations, which is what a leak or creeping fragmentation
+ * in the request path looks like.  Where allocations are counted, also
+ * fails if there are more per thousand than their own budget: churn that
+ * never shows as growth. */
+#define SOAK_INTERVAL_US 1000     // between operations, under the virtual clock
+
+static int _soak(unsigned int n)
+{
+    struct heap_sample first, h;
+    unsigned int i, step = n / 20 ? n / 20 : 1, warm = n / 10, failed = 0;
+    double growth;
+    int ret;
+#ifdef COUNTING_ALLOCS
+    double allocs;
+#endif
+
+    if (_backend->start)
+        _backend->start();
+
+    printf("%10s %12s %12s %6s %10s\n", "ops", "heap bytes", "arena bytes", "frag%", "rss KiB");
+    _heap_sample(&first);
+    for (i = 0; i < n; i++) {
+        char path[16], buf[4];
+        int relay = i % _num_relays;
+
+        if (_virtual_clock) {
+            dkrfs_sleep_us(SOAK_INTERVAL_US);
+            _run_due();
+        }
+        snprintf(path, sizeof(path), "/r%d", relay + 1);
+        if (_read(path, buf, sizeof(buf), 0, NULL) != 1)
+            failed++;
+        else if (i % 4 == 3 && _write(path, buf, 1, 0, NULL) != 1)
+            failed++;
+
+        if (i == warm) {
+            _heap_sample(&first);
+#ifdef COUNTING_ALLOCS
+            _allocs = 0;
+            _counting_allocs = 1;
+#endif
+        }
+        if ((i + 1) % step == 0) {
+            _heap_sample(&h);
+            printf("%10u %12zu %12zu %6.1f %10ld\n", i + 1, h.in_use, h.arena,
+                   h.arena ? 100.0 * h.free / h.arena : 0.0, h.rss_kb);
+        }
+    }
+#ifdef COUNTING_ALLOCS
+    _counting_allocs = 0;
+    allocs = n > warm ? (double)_allocs * 1000 / (n - warm) : 0;
+#endif
+    _heap_sample(&h);
+    _print_stats();
+    _backend->close();
+
+    growth = n > warm ? ((double)h.in_use - first.in_use) * 1000 / (n - warm) : 0;
+    printf("%u ops, %u failed; heap %+.1f bytes per 1000 ops, rss %+ld KiB after warm-up (budget %u bytes)\n",
+           n, failed, growth, h.rss_kb - first.rss_kb, _soak_budget);
+    ret = growth > _soak_budget;
+#ifdef COUNTING_ALLOCS
+    printf("%.1f allocations per 1000 ops after warm-up (budget %u)\n", allocs, _soak_alloc_budget);
+    ret |= allocs > _soak_alloc_budget;
+#endif
+
+    return ret;
+}
+
+/* Handler microbenchmarks: each file operation called directly, without
+ * the kernel, so what's measured is dkrfs's own path handling, caching
+ * and locking.  Best run with -o backend=stub so an uncached read costs
+ * a function call rather than a round trip. */
+
+static int _microbench_filler(void * buf, const char * name, const struct stat * st, off_t off)
+{
+    return 0;
+}
+
+static int _mb_getattr_relay(void)
+{
+    struct stat st;
+    return _getattr("/r3", &st);
+}
+
+static int _mb_getattr_special(void)
+{
+    struct stat st;
+    return _getattr("/.stats", &st);
+}
+
+static int _mb_getattr_missing(void)
+{
+    struct stat st;
+    return _getattr("/r99", &st) == -ENOENT ? 0 : -1;
+}
+
+static int _mb_readdir(void)
+{
+    return _readdir("/", NULL, _microbench_filler, 0, NULL);
+}
+
+static int _mb_open(void)
+{
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDONLY;
+    return _open("/r3", &fi);
+}
+
+static int _mb_read(void)
+{
+    char buf[4];
+    return _read("/r3", buf, sizeof(buf), 0, NULL) == 1 ? 0 : -1;
+}
+
+static int _mb_write(void)
+{
+    return _write("/r3", "1", 1, 0, NULL) == 1 ? 0 : -1;
+}
+
+static int _mb_read_stats(void)
+{
+    char buf[4096];
+    return _read("/.stats", buf, sizeof(buf), 0, NULL) > 0 ? 0 : -1;
+}
+
+static void _microbench_run(const char * name, int (*op)(void), unsigned int n)
+{
+    struct timespec t0, t1;
+    unsigned int i, failed = 0;
+    char allocs[16] = "-";
+    double ns;
+
+    for (i = 0; i < n / 10; i++)    // warm up
+        op();
+
+#ifdef COUNTING_ALLOCS
+    _allocs = 0;
+    _counting_allocs = 1;
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < n; i++)
+        if (op())
+            failed++;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+#ifdef COUNTING_ALLOCS
+    _counting_allocs = 0;
+    snprintf(allocs, sizeof(allocs), "%.2f", (double)_allocs / n);
+#endif
+
+    ns = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / n;
+    printf("%-24s %10.1f %10s %8u\n", name, ns, allocs, failed);
+}
+
+static int _microbench(unsigned int n)
+{
+    relay_state s[MAX_RELAYS];
+
+    if (_backend->start)
+        _backend->start();
+
+    printf("%-24s %10s %10s %8s\n", "handler", "ns/op", "allocs/op", "failed");
+    _microbench_run("getattr relay", _mb_getattr_relay, n);
+    _microbench_run("getattr special", _mb_getattr_special, n);
+    _microbench_run("getattr missing", _mb_getattr_missing, n);
+    _microbench_run("readdir", _mb_readdir, n);
+    _microbench_run("open", _mb_open, n);
+
+    _poll_ms = 0;
+    _microbench_run("read uncached", _mb_read, n);
+    _microbench_run("write", _mb_write, n);
+
+    // fresh for as long as the run could take
+    _poll_ms = 3600 * 1000;
+    _get_all(s);
+    _microbench_run("read cached", _mb_read, n);
+
+    _microbench_run("read .stats", _mb_read_stats, n);
+
+    _backend->close();
+    return 0;
+}
+
 static void usage(const char * progname) {
     printf("Usage: %s [fuse-opts] -c community -n num_relays <device-address> <mount-point>\n", progname);
+    printf("\n"
+           "dkrfs options:\n"
+           "    -o poll=MS             poll the device every MS milliseconds and serve reads from the result\n"
+           "    -o shared              share polling with other mounts of the same device (implies poll=1000)\n"
+           "    -o lockdir=DIR         directory for the shared poller lock file (default /tmp)\n"
+           "    -o agent=ADDR          answer SNMP requests for the relays on ADDR (e.g. udp:127.0.0.1:1161)\n"
+           "    -o backend=NAME        talk to the device with snmp (default), http, modbus, remote\n"
+           "                           (another dkrfs's export), replay (a recording made with record=FILE)\n"
+           "                           or stub (no device, relays kept in memory)\n"
+           "    -o export=[HOST:]PORT  serve relay states and changes to remote dkrfs mounts (implies poll=1000),\n"
+           "                           on 127.0.0.1 unless HOST is given, to clients sending the -c community\n"
+           "    -o prefetch            start reading a relay when it's opened, and the whole board on a scan\n"
+           "    -o perf                count cycles, instructions, cache misses and context switches per operation\n"
+           "    -o queue=N             allow at most N requests waiting for or at the device (default no limit)\n"
+           "    -o overload=POLICY     beyond that, fail with EBUSY (busy, the default), answer reads with the\n"
+           "                           last known state (stale) or wait for room (block)\n"
+           "    -o overload_timeout=MS how long block waits before failing with EBUSY (default 1000)\n"
+           "    -o limit=N|adaptive    allow at most N requests at the device at once, or find the most it can\n"
+           "                           take from its latency (default no limit; one at a time for SNMP)\n"
+           "    -o clock=virtual       with bench, soak or microbench, run in simulated time that only moves\n"
+           "                           with the device's recorded round trips (backend=replay or stub)\n"
+           "    -o bench=N             read the device N times through the backend, report timings and exit\n"
+           "    -o soak=N              make N reads and writes through the file handlers watching memory, and exit\n"
+           "    -o soakbudget=BYTES    heap growth per 1000 soak operations allowed before failing (default 64)\n"
+           "    -o soakallocs=N        allocations per 1000 soak operations allowed, in dkrfs-microbench (default 10)\n"
+           "    -o audit=FILE          append every command to a relay, its outcome and who gave it to FILE\n"
+           "    -o history=DIR         keep every change of relay state in DIR, for dkrfs-history\n"
+           "    -o history_keep=DAYS   drop history older than DAYS (default keep it all)\n"
+           "    -o fleet=FILE          sweep the boards listed in FILE when .fleet is read\n"
+           "    -o fleet_deadline=MS   how long a sweep waits for the slowest board (default 1000)\n"
+           "    -o idle=SECONDS        close connections to the device unused for SECONDS (SNMP only)\n"
+           "    -o microbench=N        time N calls of each file handler, cached and not, and exit\n"
+           "    -o record=FILE         record every SNMP exchange with its timing to FILE\n"
+           "    -o trace=FILE          log every filesystem operation to FILE for dkrfs-replay\n"
+           "\n");
 }
 
 static int opt_proc(void * data, const char * arg, int key, struct fuse_args * outargs)
@@ -280,6 +3993,145 @@ static int opt_proc(void * data, const char * arg, int key, struct fuse_args * o
             _community = strdup(strchr(arg, '=') + 1);
         return 0;
 
+    case KEY_POLL:
+        _poll_ms = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_SHARED:
+        _shared = 1;
+        return 0;
+
+    case KEY_LOCKDIR:
+        free(_lockdir);
+        _lockdir = strdup(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_AGENT:
+        free(_agent_addr);
+        _agent_addr = strdup(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_BACKEND: {
+        const struct backend ** b;
+        for (b = _backends; *b; b++)
+            if (!strcmp((*b)->name, strchr(arg, '=') + 1))
+                break;
+        if (!*b) {
+            fprintf(stderr, "unknown backend %s\n", strchr(arg, '=') + 1);
+            exit(1);
+        }
+        _backend = *b;
+        return 0;
+    }
+
+    case KEY_EXPORT:
+        free(_export_addr);
+        _export_addr = strdup(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_BENCH:
+        _bench_count = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_RECORD:
+        free(_record_path);
+        _record_path = strdup(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_TRACE:
+        free(_trace_path);
+        _trace_path = strdup(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_SOAK:
+        _soak_count = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_AUDIT:
+        free(_audit_path);
+        _audit_path = strdup(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_HISTORY:
+        free(_history_dir);
+        _history_dir = strdup(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_HISTORY_KEEP:
+        _history_keep_days = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_IDLE:
+        _idle_s = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_FLEET:
+        free(_fleet_path);
+        _fleet_path = strdup(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_FLEET_DEADLINE:
+        _fleet_deadline_ms = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_MICROBENCH:
+        _microbench_count = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_SOAK_BUDGET:
+        _soak_budget = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_SOAK_ALLOCS:
+        _soak_alloc_budget = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_PREFETCH:
+        _prefetch = 1;
+        return 0;
+
+    case KEY_PERF:
+        _perf = 1;
+        return 0;
+
+    case KEY_QUEUE:
+        _queue_max = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_OVERLOAD: {
+        const char * policy = strchr(arg, '=') + 1;
+        for (_overload = overload_busy; _overload <= overload_block; _overload++)
+            if (!strcmp(policy, _overload_names[_overload]))
+                break;
+        if (_overload > overload_block) {
+            fprintf(stderr, "unknown overload policy %s\n", policy);
+            exit(1);
+        }
+        return 0;
+    }
+
+    case KEY_OVERLOAD_TIMEOUT:
+        _overload_timeout_ms = atoi(strchr(arg, '=') + 1);
+        return 0;
+
+    case KEY_LIMIT: {
+        const char * limit = strchr(arg, '=') + 1;
+        if (!strcmp(limit, "adaptive")) {
+            _limit_adaptive = 1;
+            _limit = LIMIT_MAX;
+        } else {
+            _limit = atoi(limit);
+            if (_limit > LIMIT_MAX)
+                _limit = LIMIT_MAX;
+            _window = _limit;
+        }
+        return 0;
+    }
+
+    case KEY_VIRTUAL_CLOCK:
+        _virtual_clock = 1;
+        return 0;
+
     case KEY_HELP:
         usage(outargs->argv[0]);
         fuse_opt_add_arg(outargs, "-ho");
@@ -304,25 +4156,86 @@ int main(int argc, char *argv[])
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     fuse_opt_parse(&args, NULL, options, opt_proc);
 
-    if (_peername && _community) {
+    if (_peername && (_community || _backend != &_snmp_backend)) {
         unsigned int i;
-        struct snmp_session sess;
-
-        init_snmp(basename(argv[0]));
-        snmp_sess_init(&sess);
-        sess.peername = _peername;
-        sess.version = SNMP_VERSION_1;
-        sess.community = (unsigned char *)_community;
-        sess.community_len = strlen(_community);
-        _snmp_session = snmp_open(&sess);
-        if(!_snmp_session)
-            return -1;
 
+        // only the agent needs net-snmp's MIBs and transports
+        if (_agent_addr)
+            init_snmp(basename(argv[0]));
+
+        // .1.3.6.1.4.1.19865.1.2.<bank>.<relay>.0
         for (i = 0; i < _num_relays; i++) {
-            char buf[64];
-            sprintf(buf, ".1.3.6.1.4.1.19865.1.2.%d.%d.0", i / 8 + 1, i % 8 + 1);
-            _oids[i].len = MAX_OID_LEN;
-            read_objid(buf, _oids[i].id, &_oids[i].len);
+            static const oid base[] = { 1, 3, 6, 1, 4, 1, 19865, 1, 2 };
+            memcpy(_oids[i].id, base, sizeof(base));
+            _oids[i].id[9] = i / 8 + 1;
+            _oids[i].id[10] = i % 8 + 1;
+            _oids[i].id[11] = 0;
+            _oids[i].len = 12;
+        }
+
+        if (_virtual_clock && (!(_bench_count || _soak_count || _microbench_count)
+                               || (_backend != &replay_backend && _backend != &stub_backend))) {
+            fprintf(stderr, "%s: clock=virtual is only for bench, soak and microbench with backend=replay or stub\n", argv[0]);
+            return -1;
+        }
+        if (!_backend->open(_peername, _num_relays, _community))
+            return -1;
+
+        _snapshot_init(&_local_snapshot, 0);
+        _queue_init();
+        _perf_init();
+        if (_bench_count)
+            return _bench(_bench_count);
+        if (_soak_count)
+            return _soak(_soak_count);
+        if (_microbench_count)
+            return _microbench(_microbench_count);
+
+        if (_export_addr && !_poll_ms)
+            _poll_ms = 1000;
+        if (_shared) {
+            if (!_poll_ms)
+                _poll_ms = 1000;
+            if (!_shared_open())
+                fprintf(stderr, "%s: can't share state for %s, polling alone\n", argv[0], _peername);
+        }
+        if (_agent_addr && !_community) {
+            fprintf(stderr, "%s: the agent needs -c community\n", argv[0]);
+            return -1;
+        }
+        if (_export_addr && !_community) {
+            fprintf(stderr, "%s: the export needs -c community\n", argv[0]);
+            return -1;
+        }
+        if (_history_dir && access(_history_dir, W_OK)) {
+            fprintf(stderr, "%s: can't keep history in %s: %s\n", argv[0], _history_dir, strerror(errno));
+            return -1;
+        }
+        if (_fleet_path) {
+            if (!_community) {
+                fprintf(stderr, "%s: a fleet needs -c community\n", argv[0]);
+                return -1;
+            }
+            if (!_fleet_load()) {
+                fprintf(stderr, "%s: can't read fleet %s: %s\n", argv[0], _fleet_path, strerror(errno));
+                return -1;
+            }
+            _snmp_community = _community;
+        }
+        if (_audit_path && !_audit_open()) {
+            fprintf(stderr, "%s: can't open audit log %s: %s\n", argv[0], _audit_path, strerror(errno));
+            return -1;
+        }
+
+        if (_trace_path) {
+            struct trace_header h = { TRACE_MAGIC, TRACE_VERSION, 0 };
+            _trace_file = fopen(_trace_path, "w");
+            if (!_trace_file || fwrite(&h, sizeof(h), 1, _trace_file) != 1) {
+                fprintf(stderr, "%s: can't trace to %s\n", argv[0], _trace_path);
+                return -1;
+            }
+            _trace_start = _now_us();
+            return fuse_main(args.argc, args.argv, &_traced_oper, NULL);
         }
 
         return fuse_main(args.argc, args.argv, &_oper, NULL);
@@ -0,0 +1,163 @@
+/*
+This file is part of dkrfs, a fuse interface to denkovi DAEnetIP2
+
+Copyright © 2015 John Hedges <john@drystone.co.uk>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef DKRFS_H
+#define DKRFS_H
+
+#include <stdint.h>
+
+#define MAX_RELAYS 16
+
+typedef enum { relay_off, relay_on } relay_state;
+
+/* A way of talking to the device.  All calls return 1 on success and 0
+ * on failure; get_all fills one state per relay.  secret is whatever was
+ * given with -c, if anything.  open is called before
+ * fuse forks into the background so anything needing threads belongs in
+ * start, which may be NULL.  set_mask sets the relays in mask to their
+ * bits in as few requests as the device allows; without it they're set
+ * one at a time. */
+struct backend {
+    const char * name;
+    int (*open)(const char * peer, unsigned int num_relays, const char * secret);
+    int (*start)(void);
+    void (*close)(void);
+    int (*get)(int relay_num, relay_state * s);
+    int (*set)(int relay_num, relay_state s);
+    int (*get_all)(relay_state * s);
+    int (*set_mask)(uint32_t mask, uint32_t bits);
+};
+
+extern const struct backend remote_backend;
+extern const struct backend http_backend;
+extern const struct backend modbus_backend;
+extern const struct backend replay_backend;
+extern const struct backend stub_backend;
+
+/* Capture files made with -o record=FILE and played back by the replay
+ * backend: a header then one record per SNMP exchange, host byte order.
+ * bits are the values set for a SET and those returned for a GET. */
+#define CAPTURE_MAGIC   0x43524b44      // "DKRC"
+#define CAPTURE_VERSION 1
+
+enum { CAPTURE_GET, CAPTURE_SET };
+enum { CAPTURE_OK, CAPTURE_ERROR, CAPTURE_TIMEOUT };
+
+struct capture_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t num_relays;
+};
+
+struct capture_record {
+    uint32_t gap_us;        // since the previous exchange started
+    uint32_t rtt_us;
+    uint8_t command;
+    uint8_t status;
+    uint16_t mask;
+    uint16_t bits;
+    uint16_t reserved;
+};
+
+/* Traces of fuse operations made with -o trace=FILE and played back by
+ * dkrfs-replay: a header then a record per operation, host byte order. */
+#define TRACE_MAGIC     0x54524b44      // "DKRT"
+#define TRACE_VERSION   1
+
+enum {
+    TRACE_GETATTR,
+    TRACE_READDIR,
+    TRACE_OPEN,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_RELEASE,
+    TRACE_TRUNCATE,
+    TRACE_CHMOD,
+    TRACE_CHOWN,
+    TRACE_UTIME,
+    TRACE_IOCTL,
+    TRACE_OPS
+};
+
+struct trace_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+};
+
+struct trace_record {
+    uint64_t start_us;      // since the trace began
+    uint32_t duration_us;
+    int32_t pid;
+    int32_t result;
+    uint32_t size;          // or the mask an ioctl set
+    uint32_t offset;        // or its bits, with a compare's expect << 16
+    uint32_t flags;         // open flags, or the ioctl's request
+    uint8_t op;
+    uint8_t data[3];        // start of what was written
+    char path[28];
+};
+
+/* History kept with -o history=DIR and read by dkrfs-history: segment
+ * files named after the second they start, each a header and then a
+ * record of every relay's state each time one changed, in time order.
+ * Records are fixed size and complete, so a segment is its own time
+ * index: the state at any moment is the last record at or before it. */
+#define HISTORY_MAGIC   0x48524b44      // "DKRH"
+#define HISTORY_VERSION 1
+#define HISTORY_SUFFIX  ".dkrh"
+
+struct history_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t num_relays;
+    uint64_t start_us;      // realtime, the first record's time
+};
+
+struct history_record {
+    uint64_t time_us;       // realtime
+    uint32_t bits;
+    uint32_t known;         // relays whose state was known by then
+};
+
+/* For backends that learn of relay states without being asked. */
+void dkrfs_observed(uint32_t mask, uint32_t bits);
+
+/* For backends to say that the request they're carrying out on this
+ * thread has stopped waiting for a connection and gone to the device. */
+void dkrfs_sent(void);
+
+/* The daemon's clock: monotonic time in microseconds, or with
+ * -o clock=virtual a count that only moves when something sleeps on it.
+ * Backends that simulate a device wait with dkrfs_sleep_us(). */
+uint64_t dkrfs_now_us(void);
+void dkrfs_sleep_us(uint64_t us);
+
+static inline uint32_t dkrfs_bits(const relay_state * s, unsigned int n)
+{
+    uint32_t bits = 0;
+    unsigned int i;
+    for (i = 0; i < n; i++)
+        if (s[i] == relay_on)
+            bits |= 1u << i;
+    return bits;
+}
+
+#endif
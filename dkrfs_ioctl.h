@@ -0,0 +1,59 @@
+/*
+This file is part of dkrfs, a fuse interface to denkovi DAEnetIP2
+
+Copyright © 2015 John Hedges <john@drystone.co.uk>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Binary access to a whole board through ioctl(2) on the .board file of
+ * a dkrfs mount, for programs that would rather not read and write text.
+ * Relay rN is bit N-1.  Each call is one request to the device, except a
+ * compare-and-set, which reads the board and then sets it; nothing set
+ * through the same mount can come between the two.  Setting needs .board
+ * opened for writing. */
+
+#ifndef DKRFS_IOCTL_H
+#define DKRFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+struct dkrfs_board {
+    uint32_t num_relays;
+    uint32_t bits;
+};
+
+/* Set the relays in mask to their bits in bits, leaving the rest be */
+struct dkrfs_set {
+    uint32_t mask;
+    uint32_t bits;
+};
+
+/* If the relays in mask are as in expect, set them to bits.  The ioctl
+ * returns 1 if it did and 0 if not; either way found is how they were. */
+struct dkrfs_cas {
+    uint32_t mask;
+    uint32_t expect;
+    uint32_t bits;
+    uint32_t found;
+};
+
+#define DKRFS_IOC_MAGIC 'D'
+#define DKRFS_IOC_GET   _IOR(DKRFS_IOC_MAGIC, 1, struct dkrfs_board)
+#define DKRFS_IOC_SET   _IOW(DKRFS_IOC_MAGIC, 2, struct dkrfs_set)
+#define DKRFS_IOC_CAS   _IOWR(DKRFS_IOC_MAGIC, 3, struct dkrfs_cas)
+
+#endif
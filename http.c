@@ -0,0 +1,297 @@
+/*
+This file is part of dkrfs, a fuse interface to denkovi DAEnetIP2
+
+Copyright © 2015 John Hedges <john@drystone.co.uk>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Backend using the boards' web interface.  current_state.xml returns
+ * every relay in one response, and setting a relay is the same request
+ * with RelayN=V added, so a write also tells us the state of the rest.
+ * The connection is kept open between requests where the board allows. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "dkrfs.h"
+
+#define HTTP_TIMEOUT    3       // seconds
+#define HTTP_MAX_RESPONSE 8192
+
+static char * _host = NULL;
+static char * _port = NULL;
+static const char * _password = NULL;
+static unsigned int _num_relays;
+
+static int _fd = -1;
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int _connect(void)
+{
+    struct addrinfo hints, * res, * ai;
+    struct timeval tv = { HTTP_TIMEOUT, 0 };
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(_host, _port, &hints, &res))
+        return -1;
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    return fd;
+}
+
+static void _disconnect(void)
+{
+    if (_fd >= 0) {
+        close(_fd);
+        _fd = -1;
+    }
+}
+
+/* The length of the chunked body at p, len bytes of a NUL terminated
+ * buffer, once it's all there, and with decode its chunks joined up in
+ * place.  -1 if more is to come, -2 if it isn't chunked encoding. */
+static long _chunked(char * p, size_t len, int decode)
+{
+    char * start = p, * out = p, * end = p + len, * eol, * q;
+    unsigned long n;
+
+    for (;;) {
+        if (!(eol = strstr(p, "\r\n")))
+            return -1;
+        n = strtoul(p, &q, 16);
+        if (q == p || (q < eol && *q != ';' && *q != ' '))
+            return -2;
+        p = eol + 2;
+        if (!n) {
+            // any trailers, then a blank line
+            while ((eol = strstr(p, "\r\n")) && eol != p)
+                p = eol + 2;
+            return eol ? out - start : -1;
+        }
+        if (n >= (size_t)(end - p) || (size_t)(end - p) - n < 2)
+            return -1;
+        if (memcmp(p + n, "\r\n", 2))
+            return -2;
+        if (decode)
+            memmove(out, p, n);
+        out += n;
+        p += n + 2;
+    }
+}
+
+/* Read one response into buf, leaving the body at *body.  Returns the
+ * body length or -1.  Without a Content-Length or chunked encoding the
+ * body runs to the end of the connection. */
+static int _response(char * buf, size_t size, char ** body)
+{
+    size_t len = 0;
+    long clen = -1, blen = -1;
+    int keep = 1, chunked = 0;
+    char * end = NULL;
+
+    for (;;) {
+        ssize_t n;
+        int one = 1;
+
+        if (end && clen >= 0 && len - (end - buf) >= (size_t)clen)
+            break;
+        if (end && chunked && (blen = _chunked(end, len - (end - buf), 0)) != -1) {
+            if (blen < 0)
+                return -1;
+            break;
+        }
+        if (len == size - 1)
+            return -1;
+        // boards writing headers and body separately would otherwise sit
+        // out our delayed ack on every kept-alive request
+        setsockopt(_fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+        n = recv(_fd, buf + len, size - len - 1, 0);
+        if (n < 0)
+            return -1;
+        if (n == 0) {
+            if (!end || clen >= 0 || chunked)
+                return -1;
+            keep = 0;
+            break;
+        }
+        len += n;
+        buf[len] = '\0';
+
+        if (!end && (end = strstr(buf, "\r\n\r\n"))) {
+            char * h;
+            end += 4;
+            if (strncmp(buf, "HTTP/1.", 7) || strncmp(buf + 8, " 200", 4))
+                return -1;
+            for (h = strstr(buf, "\r\n"); h && h < end; h = strstr(h + 2, "\r\n")) {
+                if (!strncasecmp(h + 2, "Content-Length:", 15))
+                    clen = strtol(h + 17, NULL, 10);
+                else if (!strncasecmp(h + 2, "Connection: close", 17))
+                    keep = 0;
+                else if (!strncasecmp(h + 2, "Transfer-Encoding:", 18)) {
+                    char * v = h + 20 + strspn(h + 20, " \t");
+                    if (strncasecmp(v, "chunked\r\n", 9))
+                        return -1;      // nothing else is worth waiting out
+                    chunked = 1;
+                }
+            }
+        }
+    }
+
+    if (!keep || (clen < 0 && !chunked))
+        _disconnect();
+
+    *body = end;
+    if (chunked)
+        end[_chunked(end, len - (end - buf), 1)] = '\0';
+    else if (clen >= 0)
+        end[clen] = '\0';
+    return strlen(end);
+}
+
+/* Pull the relay states out of a current_state.xml body, which has an
+ * element per relay like <Relay3><Name>..</Name><State>1</State></Relay3> */
+static int _parse(const char * body, relay_state * s)
+{
+    unsigned int i;
+
+    for (i = 0; i < _num_relays; i++) {
+        char tag[24];
+        const char * p;
+
+        snprintf(tag, sizeof(tag), "<Relay%u>", i + 1);
+        p = strstr(body, tag);
+        if (!p || !(p = strstr(p, "<State>")))
+            return 0;
+        s[i] = p[7] == '1' ? relay_on : relay_off;
+    }
+    return 1;
+}
+
+static int _request(const char * query, relay_state * s)
+{
+    char req[256], buf[HTTP_MAX_RESPONSE], * body;
+    int n, attempt, ret = 0;
+
+    n = snprintf(req, sizeof(req),
+                 "GET /current_state.xml?pw=%s%s HTTP/1.1\r\n"
+                 "Host: %s\r\n"
+                 "Connection: keep-alive\r\n"
+                 "\r\n", _password, query, _host);
+
+    pthread_mutex_lock(&_mutex);
+    dkrfs_sent();
+    // a kept connection may have been dropped by the board, so try twice
+    for (attempt = 0; attempt < 2; attempt++) {
+        int reused = _fd >= 0;
+        if (!reused && (_fd = _connect()) < 0)
+            break;
+        if (send(_fd, req, n, MSG_NOSIGNAL) == n && _response(buf, sizeof(buf), &body) >= 0) {
+            ret = _parse(body, s);
+            break;
+        }
+        _disconnect();
+        if (!reused)
+            break;
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    return ret;
+}
+
+static int _http_open(const char * peer, unsigned int num_relays, const char * password)
+{
+    char * colon;
+
+    _host = strdup(peer);
+    colon = strrchr(_host, ':');
+    if (colon) {
+        *colon = '\0';
+        _port = colon + 1;
+    } else
+        _port = "80";
+    _num_relays = num_relays;
+    _password = password ? password : "admin";
+
+    return 1;
+}
+
+static void _http_close(void)
+{
+    _disconnect();
+    free(_host);
+    _host = _port = NULL;
+}
+
+static int _http_get_all(relay_state * s)
+{
+    return _request("", s);
+}
+
+static int _http_get(int relay_num, relay_state * s)
+{
+    relay_state all[MAX_RELAYS];
+
+    if (!_request("", all))
+        return 0;
+    *s = all[relay_num];
+    dkrfs_observed((1u << _num_relays) - 1, dkrfs_bits(all, _num_relays));
+    return 1;
+}
+
+static int _http_set(int relay_num, relay_state s)
+{
+    relay_state all[MAX_RELAYS];
+    char query[32];
+
+    snprintf(query, sizeof(query), "&Relay%d=%d", relay_num + 1, s == relay_on);
+    if (!_request(query, all))
+        return 0;
+    dkrfs_observed((1u << _num_relays) - 1, dkrfs_bits(all, _num_relays));
+    return all[relay_num] == s;
+}
+
+const struct backend http_backend = {
+    .name = "http",
+    .open = _http_open,
+    .close = _http_close,
+    .get = _http_get,
+    .set = _http_set,
+    .get_all = _http_get_all,
+};
@@ -0,0 +1,353 @@
+/*
+This file is part of dkrfs, a fuse interface to denkovi DAEnetIP2
+
+Copyright © 2015 John Hedges <john@drystone.co.uk>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Backend for smartDEN modules speaking Modbus TCP, relays being coils
+ * from address 0.  One connection carries every request; each goes out
+ * as soon as it's made and a reader thread matches replies to callers
+ * by transaction id, so concurrent reads and writes don't queue behind
+ * each other's round trips. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "dkrfs.h"
+
+#define MODBUS_TIMEOUT  3       // seconds to wait for a reply
+#define MODBUS_RETRY    1       // seconds between connection attempts
+#define MODBUS_MAX_ADU  260
+
+#define FC_READ_COILS           0x01
+#define FC_WRITE_SINGLE_COIL    0x05
+#define FC_WRITE_MULTIPLE_COILS 0x0f
+
+struct transaction {
+    uint16_t tid;
+    int done;
+    int ok;
+    uint8_t pdu[MODBUS_MAX_ADU];
+    size_t len;
+    struct transaction * next;
+};
+
+static char * _host = NULL;
+static char * _port = NULL;
+static uint8_t _unit = 1;
+static unsigned int _num_relays;
+
+static int _fd = -1;
+static int _running = 0;
+static pthread_t _thread;
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _cond;
+static uint16_t _tid = 0;
+static struct transaction * _transactions = NULL;
+
+static int _connect(void)
+{
+    struct addrinfo hints, * res, * ai;
+    int fd = -1, one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(_host, _port, &hints, &res))
+        return -1;
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    return fd;
+}
+
+static int _recv_all(int fd, uint8_t * buf, size_t len)
+{
+    while (len) {
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n <= 0)
+            return 0;
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static void * _reader(void * arg)
+{
+    uint8_t adu[MODBUS_MAX_ADU];
+
+    pthread_mutex_lock(&_mutex);
+    while (_running) {
+        struct transaction * t;
+        int fd;
+
+        pthread_mutex_unlock(&_mutex);
+        fd = _connect();
+        pthread_mutex_lock(&_mutex);
+
+        if (fd < 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += MODBUS_RETRY;
+            while (_running && pthread_cond_timedwait(&_cond, &_mutex, &ts) != ETIMEDOUT)
+                ;
+            continue;
+        }
+        _fd = fd;
+        pthread_cond_broadcast(&_cond);     // for requests waiting to be sent
+        pthread_mutex_unlock(&_mutex);
+
+        // MBAP header: transaction, protocol, length (of unit + pdu), unit
+        while (_recv_all(fd, adu, 7)) {
+            uint16_t tid = adu[0] << 8 | adu[1];
+            size_t len = adu[4] << 8 | adu[5];
+
+            if (len < 2 || len > MODBUS_MAX_ADU - 6 || !_recv_all(fd, adu + 7, len - 1))
+                break;
+
+            pthread_mutex_lock(&_mutex);
+            for (t = _transactions; t; t = t->next)
+                if (t->tid == tid && !t->done) {
+                    t->len = len - 1;
+                    memcpy(t->pdu, adu + 7, t->len);
+                    t->ok = !(t->pdu[0] & 0x80);
+                    t->done = 1;
+                    pthread_cond_broadcast(&_cond);
+                }
+            pthread_mutex_unlock(&_mutex);
+        }
+
+        pthread_mutex_lock(&_mutex);
+        _fd = -1;
+        for (t = _transactions; t; t = t->next)
+            if (!t->done) {
+                t->done = 1;
+                t->ok = 0;
+            }
+        pthread_cond_broadcast(&_cond);
+        close(fd);
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    return NULL;
+}
+
+/* Send a request pdu and wait for its reply, which replaces it in t,
+ * waiting first for a connection if we're between them, all within the
+ * one timeout. */
+static int _transact(struct transaction * t)
+{
+    struct transaction ** pt;
+    struct timespec ts;
+    uint8_t adu[MODBUS_MAX_ADU];
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += MODBUS_TIMEOUT;
+
+    pthread_mutex_lock(&_mutex);
+    while (_running && _fd < 0 && pthread_cond_timedwait(&_cond, &_mutex, &ts) != ETIMEDOUT)
+        ;
+    if (_fd < 0) {
+        pthread_mutex_unlock(&_mutex);
+        return 0;
+    }
+    dkrfs_sent();
+
+    t->tid = ++_tid;
+    t->done = 0;
+    t->next = _transactions;
+    _transactions = t;
+
+    adu[0] = t->tid >> 8;
+    adu[1] = t->tid;
+    adu[2] = 0;
+    adu[3] = 0;
+    adu[4] = (t->len + 1) >> 8;
+    adu[5] = t->len + 1;
+    adu[6] = _unit;
+    memcpy(adu + 7, t->pdu, t->len);
+    if (send(_fd, adu, t->len + 7, MSG_NOSIGNAL) != (ssize_t)t->len + 7)
+        shutdown(_fd, SHUT_RDWR);
+
+    while (!t->done && pthread_cond_timedwait(&_cond, &_mutex, &ts) != ETIMEDOUT)
+        ;
+
+    for (pt = &_transactions; *pt != t; pt = &(*pt)->next)
+        ;
+    *pt = t->next;
+    pthread_mutex_unlock(&_mutex);
+
+    return t->done && t->ok;
+}
+
+/* peer is host[:port][/unit] */
+static int _modbus_open(const char * peer, unsigned int num_relays, const char * secret)
+{
+    char * p;
+
+    _host = strdup(peer);
+    if ((p = strchr(_host, '/'))) {
+        *p++ = '\0';
+        _unit = atoi(p);
+    }
+    if ((p = strrchr(_host, ':'))) {
+        *p++ = '\0';
+        _port = p;
+    } else
+        _port = "502";
+    _num_relays = num_relays;
+
+    return 1;
+}
+
+static int _modbus_start(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    _running = 1;
+    if (pthread_create(&_thread, NULL, _reader, NULL)) {
+        _running = 0;
+        return 0;
+    }
+    return 1;
+}
+
+static void _modbus_close(void)
+{
+    if (_running) {
+        pthread_mutex_lock(&_mutex);
+        _running = 0;
+        if (_fd >= 0)
+            shutdown(_fd, SHUT_RDWR);
+        pthread_cond_broadcast(&_cond);
+        pthread_mutex_unlock(&_mutex);
+        pthread_join(_thread, NULL);
+    }
+    free(_host);
+    _host = _port = NULL;
+}
+
+static int _modbus_get_all(relay_state * s)
+{
+    struct transaction t;
+    unsigned int i;
+
+    t.pdu[0] = FC_READ_COILS;
+    t.pdu[1] = 0;
+    t.pdu[2] = 0;
+    t.pdu[3] = 0;
+    t.pdu[4] = _num_relays;
+    t.len = 5;
+    if (!_transact(&t) || t.len < 2 + (_num_relays + 7) / 8)
+        return 0;
+
+    for (i = 0; i < _num_relays; i++)
+        s[i] = t.pdu[2 + i / 8] & (1 << i % 8) ? relay_on : relay_off;
+    return 1;
+}
+
+static int _modbus_get(int relay_num, relay_state * s)
+{
+    relay_state all[MAX_RELAYS];
+
+    // costs the same as reading one coil
+    if (!_modbus_get_all(all))
+        return 0;
+    *s = all[relay_num];
+    dkrfs_observed((1u << _num_relays) - 1, dkrfs_bits(all, _num_relays));
+    return 1;
+}
+
+static int _modbus_set(int relay_num, relay_state s)
+{
+    struct transaction t;
+
+    t.pdu[0] = FC_WRITE_SINGLE_COIL;
+    t.pdu[1] = 0;
+    t.pdu[2] = relay_num;
+    t.pdu[3] = s == relay_on ? 0xff : 0x00;
+    t.pdu[4] = 0;
+    t.len = 5;
+    return _transact(&t);
+}
+
+/* One write of multiple coils for each run of consecutive relays in mask */
+static int _modbus_set_mask(uint32_t mask, uint32_t bits)
+{
+    struct transaction t;
+    unsigned int first = 0, n, i;
+
+    while (first < _num_relays) {
+        if (!(mask & (1u << first))) {
+            first++;
+            continue;
+        }
+        for (n = 0; first + n < _num_relays && mask & (1u << (first + n)); n++)
+            ;
+        t.pdu[0] = FC_WRITE_MULTIPLE_COILS;
+        t.pdu[1] = 0;
+        t.pdu[2] = first;
+        t.pdu[3] = 0;
+        t.pdu[4] = n;
+        t.pdu[5] = (n + 7) / 8;
+        memset(t.pdu + 6, 0, t.pdu[5]);
+        for (i = 0; i < n; i++)
+            if (bits & (1u << (first + i)))
+                t.pdu[6 + i / 8] |= 1 << i % 8;
+        t.len = 6 + t.pdu[5];
+        if (!_transact(&t))
+            return 0;
+        first += n;
+    }
+    return 1;
+}
+
+const struct backend modbus_backend = {
+    .name = "modbus",
+    .open = _modbus_open,
+    .start = _modbus_start,
+    .close = _modbus_close,
+    .get = _modbus_get,
+    .set = _modbus_set,
+    .get_all = _modbus_get_all,
+    .set_mask = _modbus_set_mask,
+};
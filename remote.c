@@ -0,0 +1,356 @@
+/*
+This file is part of dkrfs, a fuse interface to denkovi DAEnetIP2
+
+Copyright © 2015 John Hedges <john@drystone.co.uk>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Backend using another dkrfs's export (-o export=PORT) as the device.
+ * We subscribe and keep a mirror of its relays up to date from the
+ * change stream, so reads don't leave the host while connected.  The
+ * protocol is described with the export code in dkrfs.c. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "dkrfs.h"
+
+#define REMOTE_TIMEOUT  5       // seconds to wait for a reply
+#define REMOTE_RETRY    1       // seconds between connection attempts
+#define REMOTE_MAX_LINE 128
+
+struct pending {
+    unsigned int tag;
+    int done;
+    int ok;
+    uint32_t bits;
+    struct pending * next;
+};
+
+static char * _host = NULL;
+static char * _port = NULL;
+static char * _secret = NULL;      // the exporter's community
+static unsigned int _num_relays;
+
+static int _fd = -1;
+static int _running = 0;
+static pthread_t _thread;
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _cond;
+
+static int _subscribed = 0;
+static uint32_t _bits = 0;
+static uint32_t _known = 0;
+static unsigned int _tag = 0;
+static struct pending * _pending = NULL;
+
+static int _connect(void)
+{
+    struct addrinfo hints, * res, * ai;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(_host, _port, &hints, &res))
+        return -1;
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    return fd;
+}
+
+static void _complete(unsigned int tag, int ok, uint32_t bits)
+{
+    struct pending * p;
+
+    for (p = _pending; p; p = p->next)
+        if (p->tag == tag) {
+            p->done = 1;
+            p->ok = ok;
+            p->bits = bits;
+            pthread_cond_broadcast(&_cond);
+        }
+}
+
+static void _line(char * line)
+{
+    unsigned int tag, bits, mask, n;
+
+    if (sscanf(line, "DKRFS 2 %u", &n) == 1) {
+        if (n < _num_relays)
+            fprintf(stderr, "dkrfs: %s:%s only has %u relays\n", _host, _port, n);
+    } else if (sscanf(line, "S %x %x", &bits, &mask) == 2) {
+        pthread_mutex_lock(&_mutex);
+        _bits = bits;
+        _known = mask;
+        _subscribed = 1;
+        pthread_mutex_unlock(&_mutex);
+        dkrfs_observed(mask, bits);
+    } else if (sscanf(line, "D %x %x", &bits, &mask) == 2) {
+        pthread_mutex_lock(&_mutex);
+        _bits = (_bits & ~mask) | (bits & mask);
+        _known |= mask;
+        pthread_mutex_unlock(&_mutex);
+        dkrfs_observed(mask, bits);
+    } else if (sscanf(line, "V %u %x %x", &tag, &bits, &mask) == 3) {
+        pthread_mutex_lock(&_mutex);
+        _complete(tag, 1, bits);
+        pthread_mutex_unlock(&_mutex);
+    } else if (sscanf(line, "OK %u", &tag) == 1) {
+        pthread_mutex_lock(&_mutex);
+        _complete(tag, 1, 0);
+        pthread_mutex_unlock(&_mutex);
+    } else if (sscanf(line, "ERR %u", &tag) == 1) {
+        pthread_mutex_lock(&_mutex);
+        _complete(tag, 0, 0);
+        pthread_mutex_unlock(&_mutex);
+    }
+}
+
+static void * _reader(void * arg)
+{
+    char buf[REMOTE_MAX_LINE];
+
+    pthread_mutex_lock(&_mutex);
+    while (_running) {
+        struct pending * p;
+        size_t len = 0;
+        ssize_t n;
+        int fd;
+
+        pthread_mutex_unlock(&_mutex);
+        fd = _connect();
+        if (fd >= 0) {
+            n = snprintf(buf, sizeof(buf), "AUTH %s\nSUB\n", _secret);
+            if (n >= (int)sizeof(buf) || send(fd, buf, n, MSG_NOSIGNAL) != n) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        pthread_mutex_lock(&_mutex);
+
+        if (fd < 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += REMOTE_RETRY;
+            while (_running && pthread_cond_timedwait(&_cond, &_mutex, &ts) != ETIMEDOUT)
+                ;
+            continue;
+        }
+        _fd = fd;
+        pthread_cond_broadcast(&_cond);     // for requests waiting to be sent
+        pthread_mutex_unlock(&_mutex);
+
+        while ((n = recv(fd, buf + len, sizeof(buf) - len - 1, 0)) > 0) {
+            char * line, * nl;
+            len += n;
+            buf[len] = '\0';
+            for (line = buf; (nl = strchr(line, '\n')); line = nl + 1) {
+                *nl = '\0';
+                _line(line);
+            }
+            len -= line - buf;
+            if (len == sizeof(buf) - 1)
+                break;
+            memmove(buf, line, len);
+        }
+
+        // Lost it: nothing we hold can be trusted until we resubscribe
+        pthread_mutex_lock(&_mutex);
+        _fd = -1;
+        _subscribed = 0;
+        for (p = _pending; p; p = p->next)
+            if (!p->done) {
+                p->done = 1;
+                p->ok = 0;
+            }
+        pthread_cond_broadcast(&_cond);
+        close(fd);
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    return NULL;
+}
+
+/* Send a tagged request and wait for its reply, waiting first for a
+ * connection if we're between them, all within the one timeout. */
+static int _request(const char * fmt, int arg1, int arg2, uint32_t * bits)
+{
+    struct pending p, ** pp;
+    struct timespec ts;
+    char line[REMOTE_MAX_LINE];
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += REMOTE_TIMEOUT;
+
+    pthread_mutex_lock(&_mutex);
+    while (_running && _fd < 0 && pthread_cond_timedwait(&_cond, &_mutex, &ts) != ETIMEDOUT)
+        ;
+    if (_fd < 0) {
+        pthread_mutex_unlock(&_mutex);
+        return 0;
+    }
+    dkrfs_sent();
+
+    memset(&p, 0, sizeof(p));
+    p.tag = ++_tag;
+    p.next = _pending;
+    _pending = &p;
+
+    n = snprintf(line, sizeof(line), fmt, p.tag, arg1, arg2);
+    if (send(_fd, line, n, MSG_NOSIGNAL) != n)
+        shutdown(_fd, SHUT_RDWR);
+
+    while (!p.done && pthread_cond_timedwait(&_cond, &_mutex, &ts) != ETIMEDOUT)
+        ;
+
+    for (pp = &_pending; *pp != &p; pp = &(*pp)->next)
+        ;
+    *pp = p.next;
+    pthread_mutex_unlock(&_mutex);
+
+    if (bits)
+        *bits = p.bits;
+    return p.done && p.ok;
+}
+
+static int _remote_open(const char * peer, unsigned int num_relays, const char * secret)
+{
+    char * colon;
+
+    if (!secret) {
+        fprintf(stderr, "dkrfs: remote backend needs -c with the exporter's community\n");
+        return 0;
+    }
+    _host = strdup(peer);
+    colon = strrchr(_host, ':');
+    if (!colon) {
+        fprintf(stderr, "dkrfs: remote backend needs host:port, not %s\n", peer);
+        return 0;
+    }
+    *colon = '\0';
+    _port = colon + 1;
+    _secret = strdup(secret);
+    _num_relays = num_relays;
+
+    return 1;
+}
+
+static int _remote_start(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    _running = 1;
+    if (pthread_create(&_thread, NULL, _reader, NULL)) {
+        _running = 0;
+        return 0;
+    }
+    return 1;
+}
+
+static void _remote_close(void)
+{
+    if (_running) {
+        pthread_mutex_lock(&_mutex);
+        _running = 0;
+        if (_fd >= 0)
+            shutdown(_fd, SHUT_RDWR);
+        pthread_cond_broadcast(&_cond);
+        pthread_mutex_unlock(&_mutex);
+        pthread_join(_thread, NULL);
+    }
+    free(_host);
+    free(_secret);
+    _host = _port = _secret = NULL;
+}
+
+static int _remote_get_all(relay_state * s)
+{
+    uint32_t bits;
+    unsigned int i;
+    int ok = 1;
+
+    pthread_mutex_lock(&_mutex);
+    if (_subscribed && (_known & ((1u << _num_relays) - 1)) == (1u << _num_relays) - 1)
+        bits = _bits;
+    else
+        ok = 0;
+    pthread_mutex_unlock(&_mutex);
+
+    if (!ok && !_request("GET %u\n", 0, 0, &bits))
+        return 0;
+
+    for (i = 0; i < _num_relays; i++)
+        s[i] = bits & (1u << i) ? relay_on : relay_off;
+    return 1;
+}
+
+static int _remote_get(int relay_num, relay_state * s)
+{
+    uint32_t bits;
+    int ok = 1;
+
+    pthread_mutex_lock(&_mutex);
+    if (_subscribed && (_known & (1u << relay_num)))
+        bits = _bits;
+    else
+        ok = 0;
+    pthread_mutex_unlock(&_mutex);
+
+    if (!ok && !_request("GET %u\n", 0, 0, &bits))
+        return 0;
+
+    *s = bits & (1u << relay_num) ? relay_on : relay_off;
+    return 1;
+}
+
+static int _remote_set(int relay_num, relay_state s)
+{
+    return _request("SET %u %d %d\n", relay_num + 1, s == relay_on, NULL);
+}
+
+const struct backend remote_backend = {
+    .name = "remote",
+    .open = _remote_open,
+    .start = _remote_start,
+    .close = _remote_close,
+    .get = _remote_get,
+    .set = _remote_set,
+    .get_all = _remote_get_all,
+};
@@ -0,0 +1,149 @@
+/*
+This file is part of dkrfs, a fuse interface to denkovi DAEnetIP2
+
+Copyright © 2015 John Hedges <john@drystone.co.uk>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Backend standing in for a device by playing back a capture made with
+ * -o record=FILE.  Each request is answered by the next recorded
+ * exchange of the same kind for the same relays, after that exchange's
+ * round trip time, and one at a time as the SNMP session was. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dkrfs.h"
+
+static struct capture_record * _records = NULL;
+static size_t _nrecords = 0;
+static size_t _cursor = 0;
+static unsigned int _num_relays;
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int _replay_open(const char * peer, unsigned int num_relays, const char * secret)
+{
+    struct capture_header h;
+    FILE * f = fopen(peer, "r");
+    size_t size = 0;
+
+    if (!f || fread(&h, sizeof(h), 1, f) != 1
+            || h.magic != CAPTURE_MAGIC || h.version != CAPTURE_VERSION) {
+        fprintf(stderr, "dkrfs: %s isn't a capture file\n", peer);
+        if (f)
+            fclose(f);
+        return 0;
+    }
+    if (h.num_relays != num_relays)
+        fprintf(stderr, "dkrfs: %s was recorded with %u relays\n", peer, h.num_relays);
+
+    for (;;) {
+        if (_nrecords == size) {
+            struct capture_record * r;
+            size = size ? size * 2 : 1024;
+            if (!(r = realloc(_records, size * sizeof(*r))))
+                break;
+            _records = r;
+        }
+        if (fread(&_records[_nrecords], sizeof(*_records), 1, f) != 1)
+            break;
+        _nrecords++;
+    }
+    fclose(f);
+
+    _num_relays = num_relays;
+    return _nrecords > 0;
+}
+
+static void _replay_close(void)
+{
+    free(_records);
+    _records = NULL;
+    _nrecords = _cursor = 0;
+}
+
+/* Play the next exchange matching the request, wrapping round to the
+ * start of the capture if need be. */
+static int _exchange(int command, uint16_t mask, uint16_t bits, uint16_t * result)
+{
+    size_t i, n;
+    int ret = 0;
+
+    pthread_mutex_lock(&_mutex);
+    dkrfs_sent();
+    for (n = 0, i = _cursor; n < _nrecords; n++, i = (i + 1) % _nrecords) {
+        struct capture_record * r = &_records[i];
+        if (r->command != command || r->mask != mask
+                || (command == CAPTURE_SET && r->bits != bits))
+            continue;
+
+        dkrfs_sleep_us(r->rtt_us);
+
+        ret = r->status == CAPTURE_OK;
+        if (result)
+            *result = r->bits;
+        _cursor = (i + 1) % _nrecords;
+        break;
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    return ret;
+}
+
+static int _replay_get_all(relay_state * s)
+{
+    uint16_t all = (1u << _num_relays) - 1, bits;
+    unsigned int i;
+
+    if (!_exchange(CAPTURE_GET, all, 0, &bits))
+        return 0;
+    for (i = 0; i < _num_relays; i++)
+        s[i] = bits & (1u << i) ? relay_on : relay_off;
+    return 1;
+}
+
+static int _replay_get(int relay_num, relay_state * s)
+{
+    uint16_t bits;
+
+    if (!_exchange(CAPTURE_GET, 1u << relay_num, 0, &bits))
+        return 0;
+    *s = bits & (1u << relay_num) ? relay_on : relay_off;
+    return 1;
+}
+
+static int _replay_set(int relay_num, relay_state s)
+{
+    return _exchange(CAPTURE_SET, 1u << relay_num, s == relay_on ? 1u << relay_num : 0, NULL);
+}
+
+static int _replay_set_mask(uint32_t mask, uint32_t bits)
+{
+    return _exchange(CAPTURE_SET, mask, bits & mask, NULL);
+}
+
+const struct backend replay_backend = {
+    .name = "replay",
+    .open = _replay_open,
+    .close = _replay_close,
+    .get = _replay_get,
+    .set = _replay_set,
+    .get_all = _replay_get_all,
+    .set_mask = _replay_set_mask,
+};
@@ -0,0 +1,86 @@
+/*
+This file is part of dkrfs, a fuse interface to denkovi DAEnetIP2
+
+Copyright © 2015 John Hedges <john@drystone.co.uk>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Backend with no device behind it: relays are bits in memory and every
+ * request succeeds at once, never showing in .queue as sent.  For measuring what dkrfs itself costs, as
+ * -o microbench does, without a network round trip in the way. */
+
+#include <stdint.h>
+
+#include "dkrfs.h"
+
+static uint32_t _bits;
+static unsigned int _num_relays;
+
+static int _stub_open(const char * peer, unsigned int num_relays, const char * secret)
+{
+    _num_relays = num_relays;
+    _bits = 0;
+    return 1;
+}
+
+static void _stub_close(void)
+{
+}
+
+static int _stub_get_all(relay_state * s)
+{
+    uint32_t bits = __atomic_load_n(&_bits, __ATOMIC_RELAXED);
+    unsigned int i;
+
+    for (i = 0; i < _num_relays; i++)
+        s[i] = bits & (1u << i) ? relay_on : relay_off;
+    return 1;
+}
+
+static int _stub_get(int relay_num, relay_state * s)
+{
+    *s = __atomic_load_n(&_bits, __ATOMIC_RELAXED) & (1u << relay_num) ? relay_on : relay_off;
+    return 1;
+}
+
+static int _stub_set(int relay_num, relay_state s)
+{
+    if (s == relay_on)
+        __atomic_or_fetch(&_bits, 1u << relay_num, __ATOMIC_RELAXED);
+    else
+        __atomic_and_fetch(&_bits, ~(1u << relay_num), __ATOMIC_RELAXED);
+    return 1;
+}
+
+static int _stub_set_mask(uint32_t mask, uint32_t bits)
+{
+    uint32_t old = __atomic_load_n(&_bits, __ATOMIC_RELAXED);
+
+    while (!__atomic_compare_exchange_n(&_bits, &old, (old & ~mask) | (bits & mask), 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return 1;
+}
+
+const struct backend stub_backend = {
+    .name = "stub",
+    .open = _stub_open,
+    .close = _stub_close,
+    .get = _stub_get,
+    .set = _stub_set,
+    .get_all = _stub_get_all,
+    .set_mask = _stub_set_mask,
+};
@@ -0,0 +1,483 @@
+/*
+This file is part of dkrfs, a fuse interface to denkovi DAEnetIP2
+
+Copyright © 2015 John Hedges <john@drystone.co.uk>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* UDP proxy that sits between dkrfs and an SNMP agent, real or not, and
+ * makes the network worse on purpose: it drops, duplicates, delays and
+ * reorders datagrams, and blacks the link out altogether on a schedule.
+ * Each client address gets its own socket towards the agent so replies
+ * find their way back to the session that asked.  Counters go to stderr
+ * every -i seconds and on exit. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define MAX_CLIENTS     64
+#define MAX_PENDING     4096    // datagrams held back for delay or reordering
+#define MAX_DATAGRAM    65536
+#define CLIENT_IDLE_S   60      // before a client's upstream socket can be reused
+
+enum { UP, DOWN, DIRECTIONS };     // towards the agent, back to the client
+
+static const char * _direction_names[DIRECTIONS] = { "up", "down" };
+
+enum delay_kind { delay_none, delay_fixed, delay_uniform, delay_exp, delay_pareto };
+
+struct delay {
+    enum delay_kind kind;
+    double a, b;            // ms: fixed a; uniform a..b; exp mean a; pareto minimum a, shape b
+};
+
+struct client {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int fd;                 // connected to the agent
+    time_t last;
+};
+
+struct pending {
+    uint64_t due_us;
+    int fd;
+    struct sockaddr_storage to;
+    socklen_t tolen;
+    size_t len;
+    unsigned char * data;
+};
+
+static double _loss, _duplicate, _reorder;     // probabilities
+static unsigned int _reorder_ms = 10;
+static struct delay _delay;
+static unsigned int _blackout_every, _blackout_for;   // seconds
+static unsigned int _interval;
+
+static struct client _clients[MAX_CLIENTS];
+static unsigned int _nclients;
+static struct pending _heap[MAX_PENDING];      // soonest first
+static unsigned int _npending;
+
+static struct {
+    unsigned long long received, forwarded, lost, duplicated, reordered, blacked_out, overflowed;
+} _counts[DIRECTIONS];
+
+static uint64_t _rng;
+static volatile sig_atomic_t _stop;
+
+static uint64_t _now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64*, seeded with -S for a repeatable run */
+static double _random(void)
+{
+    _rng ^= _rng >> 12;
+    _rng ^= _rng << 25;
+    _rng ^= _rng >> 27;
+    return ((_rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t _delay_us(void)
+{
+    double ms = 0;
+
+    switch (_delay.kind) {
+    case delay_none:
+        break;
+    case delay_fixed:
+        ms = _delay.a;
+        break;
+    case delay_uniform:
+        ms = _delay.a + (_delay.b - _delay.a) * _random();
+        break;
+    case delay_exp:
+        ms = -_delay.a * log(1 - _random());
+        break;
+    case delay_pareto:
+        ms = _delay.a / pow(1 - _random(), 1 / _delay.b);
+        break;
+    }
+    return ms * 1000;
+}
+
+static int _parse_delay(const char * spec)
+{
+    char kind[16];
+    int n;
+
+    if (sscanf(spec, "%15[a-z]:%n", kind, &n) != 1)
+        return 0;
+    spec += n;
+    if (!strcmp(kind, "fixed") && sscanf(spec, "%lf", &_delay.a) == 1)
+        _delay.kind = delay_fixed;
+    else if (!strcmp(kind, "uniform") && sscanf(spec, "%lf-%lf", &_delay.a, &_delay.b) == 2)
+        _delay.kind = delay_uniform;
+    else if (!strcmp(kind, "exp") && sscanf(spec, "%lf", &_delay.a) == 1)
+        _delay.kind = delay_exp;
+    else if (!strcmp(kind, "pareto") && sscanf(spec, "%lf:%lf", &_delay.a, &_delay.b) == 2 && _delay.b > 0)
+        _delay.kind = delay_pareto;
+    else
+        return 0;
+    return 1;
+}
+
+static void _pending_push(struct pending * p)
+{
+    unsigned int i = _npending++;
+
+    while (i && _heap[(i - 1) / 2].due_us > p->due_us) {
+        _heap[i] = _heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    _heap[i] = *p;
+}
+
+static void _pending_pop(void)
+{
+    struct pending last = _heap[--_npending];
+    unsigned int i = 0;
+
+    for (;;) {
+        unsigned int c = 2 * i + 1;
+        if (c >= _npending)
+            break;
+        if (c + 1 < _npending && _heap[c + 1].due_us < _heap[c].due_us)
+            c++;
+        if (_heap[c].due_us >= last.due_us)
+            break;
+        _heap[i] = _heap[c];
+        i = c;
+    }
+    _heap[i] = last;
+}
+
+static int _blacked_out(void)
+{
+    static uint64_t start;
+
+    if (!_blackout_every)
+        return 0;
+    if (!start)
+        start = _now_us();
+    return (_now_us() - start) / 1000000 % _blackout_every >= _blackout_every - _blackout_for;
+}
+
+/* One datagram through the impairments, in either direction */
+static void _forward(int dir, int fd, const struct sockaddr_storage * to, socklen_t tolen,
+                     const unsigned char * data, size_t len)
+{
+    int copies = 1, i;
+
+    _counts[dir].received++;
+    if (_blacked_out()) {
+        _counts[dir].blacked_out++;
+        return;
+    }
+    if (_random() < _loss) {
+        _counts[dir].lost++;
+        return;
+    }
+    if (_random() < _duplicate) {
+        _counts[dir].duplicated++;
+        copies = 2;
+    }
+
+    for (i = 0; i < copies; i++) {
+        struct pending p;
+
+        p.due_us = _now_us() + _delay_us();
+        if (_random() < _reorder) {
+            // held back long enough for whatever comes next to overtake it
+            _counts[dir].reordered++;
+            p.due_us += _reorder_ms * 1000;
+        }
+        if (_npending == MAX_PENDING || !(p.data = malloc(len))) {
+            _counts[dir].overflowed++;
+            continue;
+        }
+        memcpy(p.data, data, len);
+        p.len = len;
+        p.fd = fd;
+        p.tolen = tolen;
+        if (to)
+            memcpy(&p.to, to, tolen);
+        _pending_push(&p);
+        _counts[dir].forwarded++;
+    }
+}
+
+static void _send_due(void)
+{
+    uint64_t now = _now_us();
+
+    while (_npending && _heap[0].due_us <= now) {
+        struct pending * p = &_heap[0];
+        if (p->tolen)
+            sendto(p->fd, p->data, p->len, 0, (struct sockaddr *)&p->to, p->tolen);
+        else
+            send(p->fd, p->data, p->len, 0);
+        free(p->data);
+        _pending_pop();
+    }
+}
+
+/* The upstream socket for a client, opening one or taking over the
+ * longest idle if need be */
+static struct client * _client_for(const struct sockaddr_storage * addr, socklen_t addrlen,
+                                   const struct addrinfo * agent)
+{
+    struct client * c, * oldest = NULL;
+    unsigned int i;
+
+    for (i = 0; i < _nclients; i++) {
+        c = &_clients[i];
+        if (c->addrlen == addrlen && !memcmp(&c->addr, addr, addrlen)) {
+            c->last = time(NULL);
+            return c;
+        }
+        if (!oldest || c->last < oldest->last)
+            oldest = c;
+    }
+
+    if (_nclients < MAX_CLIENTS)
+        c = &_clients[_nclients++];
+    else if (time(NULL) - oldest->last >= CLIENT_IDLE_S) {
+        c = oldest;
+        close(c->fd);
+    } else
+        return NULL;
+
+    c->fd = socket(agent->ai_family, SOCK_DGRAM, 0);
+    if (c->fd < 0 || connect(c->fd, agent->ai_addr, agent->ai_addrlen) < 0) {
+        if (c->fd >= 0)
+            close(c->fd);
+        *c = _clients[--_nclients];
+        return NULL;
+    }
+    memcpy(&c->addr, addr, addrlen);
+    c->addrlen = addrlen;
+    c->last = time(NULL);
+    return c;
+}
+
+static void _report(void)
+{
+    int dir;
+
+    for (dir = 0; dir < DIRECTIONS; dir++)
+        fprintf(stderr, "%-4s received %llu forwarded %llu lost %llu duplicated %llu reordered %llu "
+                "blacked_out %llu overflowed %llu\n", _direction_names[dir],
+                _counts[dir].received, _counts[dir].forwarded, _counts[dir].lost,
+                _counts[dir].duplicated, _counts[dir].reordered, _counts[dir].blacked_out,
+                _counts[dir].overflowed);
+}
+
+static void _on_signal(int sig)
+{
+    _stop = 1;
+}
+
+/* host:port, or just port for the listening side; an IPv6 host is in
+ * brackets, or bare if there's no port */
+static struct addrinfo * _resolve(const char * spec, const char * default_port, int passive)
+{
+    struct addrinfo hints, * ai = NULL;
+    char host[256];
+    const char * port = default_port, * end;
+
+    if (*spec == '[') {
+        if (!(end = strchr(++spec, ']')))
+            return NULL;
+        if (end[1] == ':')
+            port = end + 2;
+        else if (end[1])
+            return NULL;
+    } else if ((end = strchr(spec, ':')) && !strchr(end + 1, ':'))
+        port = end + 1;
+    else if (!end && passive) {
+        port = spec;
+        end = spec;
+    } else
+        end = spec + strlen(spec);
+    if ((size_t)(end - spec) >= sizeof(host))
+        return NULL;
+    memcpy(host, spec, end - spec);
+    host[end - spec] = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    if (getaddrinfo(host[0] ? host : NULL, port, &hints, &ai))
+        return NULL;
+    return ai;
+}
+
+static void usage(const char * progname)
+{
+    printf("Usage: %s [options] [<listen-host>:]<port> <agent-host>[:<port>]\n"
+           "\n"
+           "    -l PCT          drop PCT%% of datagrams\n"
+           "    -d PCT          send PCT%% twice\n"
+           "    -r PCT[:MS]     hold PCT%% back a further MS (default 10) so later ones overtake them\n"
+           "    -D SPEC         delay every datagram: fixed:MS, uniform:MIN-MAX, exp:MEAN or\n"
+           "                    pareto:MIN:SHAPE (heavy tailed, a shape under 2 is nasty)\n"
+           "    -b EVERY:FOR    drop everything for the last FOR seconds of every EVERY\n"
+           "    -S SEED         seed the random choices for a repeatable run\n"
+           "    -i SECONDS      print counters every SECONDS as well as on exit\n"
+           "\n"
+           "Impairments apply in both directions; the agent's port defaults to 161.\n", progname);
+}
+
+int main(int argc, char * argv[])
+{
+    struct addrinfo * listen_ai, * agent_ai;
+    static unsigned char buf[MAX_DATAGRAM];
+    struct sigaction sa;
+    time_t next_report;
+    int opt, lfd, one = 1;
+
+    _rng = _now_us() | 1;
+    while ((opt = getopt(argc, argv, "l:d:r:D:b:S:i:h")) != -1) {
+        switch (opt) {
+        case 'l':
+            _loss = atof(optarg) / 100;
+            break;
+        case 'd':
+            _duplicate = atof(optarg) / 100;
+            break;
+        case 'r':
+            _reorder = atof(optarg) / 100;
+            if (strchr(optarg, ':'))
+                _reorder_ms = atoi(strchr(optarg, ':') + 1);
+            break;
+        case 'D':
+            if (!_parse_delay(optarg)) {
+                fprintf(stderr, "%s: bad delay %s\n", argv[0], optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            if (sscanf(optarg, "%u:%u", &_blackout_every, &_blackout_for) != 2
+                    || _blackout_for > _blackout_every) {
+                fprintf(stderr, "%s: bad blackout %s\n", argv[0], optarg);
+                return 1;
+            }
+            break;
+        case 'S':
+            _rng = strtoull(optarg, NULL, 0) | 1;
+            break;
+        case 'i':
+            _interval = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!(listen_ai = _resolve(argv[optind], NULL, 1))) {
+        fprintf(stderr, "%s: can't listen on %s\n", argv[0], argv[optind]);
+        return 1;
+    }
+    if (!(agent_ai = _resolve(argv[optind + 1], "161", 0))) {
+        fprintf(stderr, "%s: can't find %s\n", argv[0], argv[optind + 1]);
+        return 1;
+    }
+    lfd = socket(listen_ai->ai_family, SOCK_DGRAM, 0);
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (lfd < 0 || bind(lfd, listen_ai->ai_addr, listen_ai->ai_addrlen) < 0) {
+        fprintf(stderr, "%s: can't listen on %s: %s\n", argv[0], argv[optind], strerror(errno));
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    next_report = _interval ? time(NULL) + _interval : 0;
+    while (!_stop) {
+        struct pollfd fds[1 + MAX_CLIENTS];
+        unsigned int i, nfds = 0;
+        int timeout = 1000;
+        ssize_t len;
+
+        fds[nfds].fd = lfd;
+        fds[nfds++].events = POLLIN;
+        for (i = 0; i < _nclients; i++) {
+            fds[nfds].fd = _clients[i].fd;
+            fds[nfds++].events = POLLIN;
+        }
+        if (_npending) {
+            uint64_t now = _now_us();
+            timeout = _heap[0].due_us <= now ? 0 : (_heap[0].due_us - now + 999) / 1000;
+        }
+
+        if (poll(fds, nfds, timeout) < 0 && errno != EINTR)
+            break;
+
+        if (fds[0].revents & POLLIN) {
+            struct sockaddr_storage from;
+            socklen_t fromlen = sizeof(from);
+            struct client * c;
+
+            len = recvfrom(lfd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen);
+            if (len >= 0 && (c = _client_for(&from, fromlen, agent_ai)))
+                _forward(UP, c->fd, NULL, 0, buf, len);
+        }
+        // the client list may have changed above, but only at the end
+        for (i = 1; i < nfds; i++) {
+            struct client * c = &_clients[i - 1];
+            if (!(fds[i].revents & POLLIN) || c->fd != fds[i].fd)
+                continue;
+            len = recv(c->fd, buf, sizeof(buf), 0);
+            if (len >= 0)
+                _forward(DOWN, lfd, &c->addr, c->addrlen, buf, len);
+        }
+
+        _send_due();
+
+        if (next_report && time(NULL) >= next_report) {
+            _report();
+            next_report = time(NULL) + _interval;
+        }
+    }
+
+    _report();
+    freeaddrinfo(listen_ai);
+    freeaddrinfo(agent_ai);
+    return 0;
+}
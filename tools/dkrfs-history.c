@@ -0,0 +1,294 @@
+/*
+This file is part of dkrfs, a fuse interface to denkovi DAEnetIP2
+
+Copyright © 2015 John Hedges <john@drystone.co.uk>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Answers questions about a history directory kept with -o history=DIR:
+ * what every relay (or one) was at a moment, found by binary search of
+ * the segment names and then of the segment's records, or the changes
+ * over a period. */
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dkrfs.h"
+
+struct segment {
+    const struct history_header * h;
+    const struct history_record * records;
+    size_t n;
+    size_t size;
+};
+
+static const char * _dir;
+static struct dirent ** _names;
+static int _nnames;
+
+static int _filter(const struct dirent * d)
+{
+    size_t len = strlen(d->d_name), suffix = strlen(HISTORY_SUFFIX);
+    return len > suffix && !strcmp(d->d_name + len - suffix, HISTORY_SUFFIX);
+}
+
+static int _map(int i, struct segment * s)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    void * p;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", _dir, _names[i]->d_name);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return 0;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct history_header)) {
+        close(fd);
+        return 0;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return 0;
+
+    s->h = p;
+    s->records = (const struct history_record *)(s->h + 1);
+    s->n = (st.st_size - sizeof(*s->h)) / sizeof(*s->records);
+    s->size = st.st_size;
+    if (s->h->magic != HISTORY_MAGIC || s->h->version != HISTORY_VERSION) {
+        fprintf(stderr, "%s isn't a dkrfs history segment\n", path);
+        munmap(p, s->size);
+        return 0;
+    }
+    return 1;
+}
+
+static void _unmap(struct segment * s)
+{
+    munmap((void *)s->h, s->size);
+}
+
+/* The last segment named for a second no later than t's */
+static int _segment_for(uint64_t t_us)
+{
+    long long t = t_us / 1000000;
+    int lo = 0, hi = _nnames;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (atoll(_names[mid]->d_name) <= t)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+/* Index of the first record after t */
+static size_t _after(const struct segment * s, uint64_t t_us)
+{
+    size_t lo = 0, hi = s->n;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (s->records[mid].time_us <= t_us)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* The record in force at t: the last at or before it, which may be the
+ * end of the segment before if t falls between the two. */
+static int _state_at(uint64_t t_us, struct history_record * r, unsigned int * num_relays)
+{
+    int i;
+
+    for (i = _segment_for(t_us); i >= 0; i--) {
+        struct segment s;
+        size_t k;
+
+        if (!_map(i, &s))
+            continue;
+        k = _after(&s, t_us);
+        if (k) {
+            *r = s.records[k - 1];
+            *num_relays = s.h->num_relays;
+        }
+        _unmap(&s);
+        if (k)
+            return 1;
+    }
+    return 0;
+}
+
+static void _print_time(uint64_t t_us)
+{
+    time_t t = t_us / 1000000;
+    struct tm tm;
+    char buf[32];
+
+    localtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%06u", buf, (unsigned int)(t_us % 1000000));
+}
+
+/* Every change from one time to another, relay by relay */
+static void _changes(uint64_t from_us, uint64_t to_us, int relay)
+{
+    struct history_record prev;
+    unsigned int num_relays = 0;
+    int have_prev = _state_at(from_us, &prev, &num_relays);
+    int i = _segment_for(from_us);
+
+    for (i = i < 0 ? 0 : i; i < _nnames; i++) {
+        struct segment s;
+        size_t k;
+
+        if (!_map(i, &s))
+            continue;
+        if (s.h->start_us > to_us) {
+            _unmap(&s);
+            break;
+        }
+        for (k = _after(&s, from_us); k < s.n && s.records[k].time_us <= to_us; k++) {
+            const struct history_record * r = &s.records[k];
+            uint32_t changed = (have_prev ? (prev.bits ^ r->bits) | (prev.known ^ r->known) : r->known);
+            unsigned int j;
+
+            for (j = 0; j < s.h->num_relays; j++) {
+                if (!(changed & (1u << j)) || (relay >= 0 && j != relay) || !(r->known & (1u << j)))
+                    continue;
+                _print_time(r->time_us);
+                printf(" r%u %d\n", j + 1, !!(r->bits & (1u << j)));
+            }
+            prev = *r;
+            have_prev = 1;
+        }
+        _unmap(&s);
+    }
+}
+
+/* Seconds since the epoch, with a fraction if wanted, or a local
+ * YYYY-MM-DD[ HH:MM[:SS]] */
+static int _parse_time(const char * arg, uint64_t * t_us)
+{
+    static const char * formats[] = {
+        "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d", NULL
+    };
+    const char ** f;
+    char * end;
+    double secs = strtod(arg, &end);
+
+    if (*arg && !*end) {
+        *t_us = secs * 1e6;
+        return 1;
+    }
+    for (f = formats; *f; f++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        end = strptime(arg, *f, &tm);
+        if (end && !*end) {
+            tm.tm_isdst = -1;
+            *t_us = (uint64_t)mktime(&tm) * 1000000;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void usage(const char * progname)
+{
+    printf("Usage: %s [-r relay] <history-dir> [time]\n"
+           "       %s -c [-r relay] [-f from] [-t to] <history-dir>\n"
+           "\n"
+           "The first form gives each relay's state at a time (default now), the second every\n"
+           "change between two (default the beginning and now).  Times are seconds since the\n"
+           "epoch or local YYYY-MM-DD[ HH:MM[:SS]].\n", progname, progname);
+}
+
+int main(int argc, char * argv[])
+{
+    uint64_t now_us = (uint64_t)time(NULL) * 1000000 + 999999, from_us = 0, to_us = now_us;
+    int opt, relay = -1, changes = 0;
+
+    while ((opt = getopt(argc, argv, "r:cf:t:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            relay = atoi(optarg) - 1;
+            break;
+        case 'c':
+            changes = 1;
+            break;
+        case 'f':
+        case 't':
+            if (!_parse_time(optarg, opt == 'f' ? &from_us : &to_us)) {
+                fprintf(stderr, "%s: can't make sense of time %s\n", argv[0], optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (argc - optind < 1 || argc - optind > (changes ? 1 : 2)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    _dir = argv[optind];
+    if ((_nnames = scandir(_dir, &_names, _filter, alphasort)) < 0) {
+        perror(_dir);
+        return 1;
+    }
+
+    if (changes)
+        _changes(from_us, to_us, relay);
+    else {
+        struct history_record r;
+        unsigned int num_relays, j;
+        uint64_t t_us = now_us;
+
+        if (argc - optind == 2 && !_parse_time(argv[optind + 1], &t_us)) {
+            fprintf(stderr, "%s: can't make sense of time %s\n", argv[0], argv[optind + 1]);
+            return 1;
+        }
+        if (!_state_at(t_us, &r, &num_relays)) {
+            fprintf(stderr, "%s: no history that far back\n", argv[0]);
+            return 1;
+        }
+        for (j = 0; j < num_relays; j++) {
+            if (relay >= 0 && j != relay)
+                continue;
+            if (r.known & (1u << j))
+                printf("r%u %d\n", j + 1, !!(r.bits & (1u << j)));
+            else
+                printf("r%u unknown\n", j + 1);
+        }
+    }
+    return 0;
+}
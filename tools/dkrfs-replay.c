@@ -0,0 +1,350 @@
+/*
+This file is part of dkrfs, a fuse interface to denkovi DAEnetIP2
+
+Copyright © 2015 John Hedges <john@drystone.co.uk>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Replay a trace made with dkrfs -o trace=FILE against a mount, issuing
+ * each operation as the nearest system call at the same offset from the
+ * start as it was traced.  Each traced process gets its own thread so
+ * concurrency is kept as well as timing.  Reports how long operations
+ * took against how long they took when traced. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#include "dkrfs.h"
+#include "dkrfs_ioctl.h"
+
+#define MAX_OPEN 16
+
+static const char * _op_names[TRACE_OPS] = {
+    "getattr", "readdir", "open", "read", "write",
+    "release", "truncate", "chmod", "chown", "utime", "ioctl"
+};
+
+struct worker {
+    pid_t pid;
+    size_t * index;         // records of this pid, in order
+    size_t n;
+    pthread_t thread;
+    struct {
+        char path[sizeof(((struct trace_record *)0)->path)];
+        int fd;
+    } open[MAX_OPEN];
+};
+
+static struct trace_record * _records;
+static uint32_t * _latency;         // replayed, per record
+static int * _failed;
+static const char * _mount;
+static double _speed = 1.0;
+static struct timespec _t0;
+
+static uint64_t _elapsed_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - _t0.tv_sec) * 1000000LL + (ts.tv_nsec - _t0.tv_nsec) / 1000;
+}
+
+static int _fd_for(struct worker * w, const char * path, int remove)
+{
+    int i, fd;
+    for (i = 0; i < MAX_OPEN; i++)
+        if (w->open[i].fd >= 0 && !strcmp(w->open[i].path, path)) {
+            fd = w->open[i].fd;
+            if (remove)
+                w->open[i].fd = -1;
+            return fd;
+        }
+    return -1;
+}
+
+static void _remember(struct worker * w, const char * path, int fd)
+{
+    int i;
+    for (i = 0; i < MAX_OPEN; i++)
+        if (w->open[i].fd < 0) {
+            strcpy(w->open[i].path, path);
+            w->open[i].fd = fd;
+            return;
+        }
+    close(fd);
+}
+
+static int _issue(struct worker * w, struct trace_record * r)
+{
+    char path[PATH_MAX], buf[4096];
+    union {
+        struct dkrfs_board board;
+        struct dkrfs_set set;
+        struct dkrfs_cas cas;
+    } arg;
+    struct stat st;
+    DIR * d;
+    int fd, ret = 0, transient = 0;
+    size_t i;
+
+    snprintf(path, sizeof(path), "%s%s", _mount, r->path);
+
+    switch (r->op) {
+    case TRACE_GETATTR:
+        return stat(path, &st);
+
+    case TRACE_READDIR:
+        if (!(d = opendir(path)))
+            return -1;
+        while (readdir(d))
+            ;
+        return closedir(d);
+
+    case TRACE_OPEN:
+        fd = open(path, r->flags & (O_ACCMODE | O_APPEND | O_TRUNC));
+        if (fd < 0)
+            return -1;
+        _remember(w, r->path, fd);
+        return 0;
+
+    case TRACE_RELEASE:
+        fd = _fd_for(w, r->path, 1);
+        return fd < 0 ? 0 : close(fd);
+
+    case TRACE_READ:
+    case TRACE_WRITE:
+        if ((fd = _fd_for(w, r->path, 0)) < 0) {
+            fd = open(path, r->op == TRACE_READ ? O_RDONLY : O_WRONLY);
+            if (fd < 0)
+                return -1;
+            transient = 1;
+        }
+        if (r->size > sizeof(buf))
+            r->size = sizeof(buf);
+        if (r->op == TRACE_READ)
+            ret = pread(fd, buf, r->size, r->offset) < 0 ? -1 : 0;
+        else {
+            for (i = 0; i < r->size; i++)
+                buf[i] = i < sizeof(r->data) ? r->data[i] : '\n';
+            ret = pwrite(fd, buf, r->size, r->offset) < 0 ? -1 : 0;
+        }
+        if (transient)
+            close(fd);
+        return ret;
+
+    case TRACE_TRUNCATE:
+        return truncate(path, r->offset);
+
+    case TRACE_CHMOD:
+        return chmod(path, r->flags);
+
+    case TRACE_UTIME:
+        return utime(path, NULL);
+
+    case TRACE_IOCTL:
+        memset(&arg, 0, sizeof(arg));
+        if (r->flags == DKRFS_IOC_SET) {
+            arg.set.mask = r->size;
+            arg.set.bits = r->offset & 0xffff;
+        } else if (r->flags == DKRFS_IOC_CAS) {
+            arg.cas.mask = r->size;
+            arg.cas.bits = r->offset & 0xffff;
+            arg.cas.expect = r->offset >> 16;
+        }
+        if ((fd = _fd_for(w, r->path, 0)) < 0) {
+            fd = open(path, r->flags == DKRFS_IOC_GET ? O_RDONLY : O_RDWR);
+            if (fd < 0)
+                return -1;
+            transient = 1;
+        }
+        ret = ioctl(fd, r->flags, &arg) < 0 ? -1 : 0;
+        if (transient)
+            close(fd);
+        return ret;
+    }
+
+    return 0;   // chown: we don't know who to
+}
+
+static void * _work(void * arg)
+{
+    struct worker * w = arg;
+    size_t i;
+    int j;
+
+    for (j = 0; j < MAX_OPEN; j++)
+        w->open[j].fd = -1;
+
+    for (i = 0; i < w->n; i++) {
+        struct trace_record * r = &_records[w->index[i]];
+        uint64_t due = r->start_us / _speed, start;
+
+        start = _elapsed_us();
+        if (due > start) {
+            struct timespec ts = { (due - start) / 1000000, (due - start) % 1000000 * 1000 };
+            nanosleep(&ts, NULL);
+        }
+
+        start = _elapsed_us();
+        _failed[w->index[i]] = _issue(w, r) < 0;
+        _latency[w->index[i]] = _elapsed_us() - start;
+    }
+
+    for (j = 0; j < MAX_OPEN; j++)
+        if (w->open[j].fd >= 0)
+            close(w->open[j].fd);
+    return NULL;
+}
+
+static int _cmp_u32(const void * a, const void * b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void _report(size_t n)
+{
+    uint32_t * traced = malloc(n * sizeof(*traced));
+    uint32_t * replayed = malloc(n * sizeof(*replayed));
+    int op;
+
+    printf("%-9s %7s %6s  %25s  %25s\n", "", "count", "failed",
+           "traced p50/p99/max ms", "replayed p50/p99/max ms");
+    for (op = 0; op < TRACE_OPS; op++) {
+        size_t i, k = 0, failed = 0;
+        for (i = 0; i < n; i++)
+            if (_records[i].op == op) {
+                traced[k] = _records[i].duration_us;
+                replayed[k++] = _latency[i];
+                failed += _failed[i];
+            }
+        if (!k)
+            continue;
+        qsort(traced, k, sizeof(*traced), _cmp_u32);
+        qsort(replayed, k, sizeof(*replayed), _cmp_u32);
+        printf("%-9s %7zu %6zu  %7.3f %8.3f %8.3f  %7.3f %8.3f %8.3f\n", _op_names[op], k, failed,
+               traced[k / 2] / 1e3, traced[k * 99 / 100] / 1e3, traced[k - 1] / 1e3,
+               replayed[k / 2] / 1e3, replayed[k * 99 / 100] / 1e3, replayed[k - 1] / 1e3);
+    }
+
+    free(traced);
+    free(replayed);
+}
+
+static void usage(const char * progname)
+{
+    printf("Usage: %s [-s speed] <trace-file> <mount-point>\n", progname);
+}
+
+int main(int argc, char * argv[])
+{
+    struct trace_header h;
+    struct worker * workers = NULL;
+    size_t n = 0, size = 0, nworkers = 0, i, j;
+    FILE * f;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+        switch (opt) {
+        case 's':
+            _speed = atof(optarg);
+            if (_speed <= 0)
+                _speed = 1.0;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    _mount = argv[optind + 1];
+
+    f = fopen(argv[optind], "r");
+    if (!f || fread(&h, sizeof(h), 1, f) != 1 || h.magic != TRACE_MAGIC || h.version != TRACE_VERSION) {
+        fprintf(stderr, "%s: %s isn't a dkrfs trace\n", argv[0], argv[optind]);
+        return 1;
+    }
+    for (;;) {
+        if (n == size) {
+            size = size ? size * 2 : 4096;
+            _records = realloc(_records, size * sizeof(*_records));
+            if (!_records)
+                return 1;
+        }
+        if (fread(&_records[n], sizeof(*_records), 1, f) != 1)
+            break;
+        _records[n].path[sizeof(_records[n].path) - 1] = '\0';
+        n++;
+    }
+    fclose(f);
+
+    // traced in completion order, which is nearly start order already
+    for (i = 1; i < n; i++)
+        for (j = i; j > 0 && _records[j - 1].start_us > _records[j].start_us; j--) {
+            struct trace_record t = _records[j];
+            _records[j] = _records[j - 1];
+            _records[j - 1] = t;
+        }
+
+    _latency = calloc(n, sizeof(*_latency));
+    _failed = calloc(n, sizeof(*_failed));
+
+    for (i = 0; i < n; i++) {
+        struct worker * w;
+        for (j = 0; j < nworkers; j++)
+            if (workers[j].pid == _records[i].pid)
+                break;
+        if (j == nworkers) {
+            workers = realloc(workers, ++nworkers * sizeof(*workers));
+            memset(&workers[j], 0, sizeof(*workers));
+            workers[j].pid = _records[i].pid;
+        }
+        w = &workers[j];
+        w->index = realloc(w->index, (w->n + 1) * sizeof(*w->index));
+        w->index[w->n++] = i;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &_t0);
+    for (j = 0; j < nworkers; j++)
+        pthread_create(&workers[j].thread, NULL, _work, &workers[j]);
+    for (j = 0; j < nworkers; j++) {
+        pthread_join(workers[j].thread, NULL);
+        free(workers[j].index);
+    }
+
+    printf("%zu operations from %zu processes in %.3fs\n", n, nworkers, _elapsed_us() / 1e6);
+    _report(n);
+
+    free(workers);
+    free(_records);
+    free(_latency);
+    free(_failed);
+    return 0;
+}
@@ -0,0 +1,257 @@
+/*
+This file is part of dkrfs, a fuse interface to denkovi DAEnetIP2
+
+Copyright © 2015 John Hedges <john@drystone.co.uk>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Live view of one or more dkrfs mounts, one line per device, from the
+ * /.stats and /.queue files of each.  Rates and round trip percentiles are over the
+ * last refresh interval; the slowest device is listed first. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+
+#define RTT_BUCKETS 32
+
+struct sample {
+    int ok;
+    char device[64];
+    char backend[16];
+    long long snapshot_age_ms;
+    unsigned long long reads, writes, errors;
+    unsigned long long hits, misses;
+    unsigned long long requests, request_errors, retries, rejected;
+    unsigned int inflight, inflight_max;
+    unsigned int queued;                // from .queue, waiting right now
+    unsigned long long rtt[RTT_BUCKETS];
+};
+
+struct mount {
+    const char * path;
+    struct sample prev, cur;
+    // over the last interval
+    double ops, reqs, errs, rejs, retries, hit;
+    long p50, p99, max;
+};
+
+static int _read_stats(const char * mount, struct sample * s)
+{
+    char path[PATH_MAX], line[512];
+    FILE * f;
+
+    memset(s, 0, sizeof(*s));
+    snprintf(path, sizeof(path), "%s/.stats", mount);
+    if (!(f = fopen(path, "r")))
+        return 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long a;
+        if (sscanf(line, "device %63s", s->device) == 1
+                || sscanf(line, "backend %15s", s->backend) == 1
+                || sscanf(line, "snapshot_age_ms %lld", &s->snapshot_age_ms) == 1
+                || sscanf(line, "cache_hits %llu", &s->hits) == 1
+                || sscanf(line, "cache_misses %llu", &s->misses) == 1
+                || sscanf(line, "requests %llu", &s->requests) == 1
+                || sscanf(line, "request_errors %llu", &s->request_errors) == 1
+                || sscanf(line, "retries %llu", &s->retries) == 1
+                || sscanf(line, "rejected %llu", &s->rejected) == 1
+                || sscanf(line, "inflight %u", &s->inflight) == 1
+                || sscanf(line, "inflight_max %u", &s->inflight_max) == 1)
+            continue;
+        if (sscanf(line, "reads %llu", &a) == 1)
+            s->reads = a;
+        else if (sscanf(line, "writes %llu", &a) == 1)
+            s->writes = a;
+        else if (sscanf(line, "read_errors %llu", &a) == 1 || sscanf(line, "write_errors %llu", &a) == 1)
+            s->errors += a;
+        else if (!strncmp(line, "rtt_us", 6)) {
+            char * p = line + 6;
+            int i, n;
+            for (i = 0; i < RTT_BUCKETS && sscanf(p, " %llu%n", &s->rtt[i], &n) == 1; i++)
+                p += n;
+        }
+    }
+    fclose(f);
+
+    snprintf(path, sizeof(path), "%s/.queue", mount);
+    if ((f = fopen(path, "r"))) {
+        while (fgets(line, sizeof(line), f))
+            if (sscanf(line, "queued %u", &s->queued) == 1)
+                break;
+        fclose(f);
+    }
+
+    return s->ok = 1;
+}
+
+/* Upper edge of the bucket holding the p'th percentile, in us. */
+static long _percentile(const unsigned long long * h, unsigned long long total, double p)
+{
+    unsigned long long want = total * p, seen = 0;
+    int i;
+
+    for (i = 0; i < RTT_BUCKETS; i++) {
+        seen += h[i];
+        if (seen > want || (seen == total && h[i]))
+            return 2L << i;
+    }
+    return 2L << (RTT_BUCKETS - 1);
+}
+
+static void _update(struct mount * m, double dt)
+{
+    unsigned long long h[RTT_BUCKETS], total = 0;
+    unsigned long long hits, misses;
+    int i;
+
+    m->prev = m->cur;
+    _read_stats(m->path, &m->cur);
+    m->p50 = m->p99 = m->max = -1;
+    m->ops = m->reqs = m->errs = m->rejs = m->retries = 0;
+    m->hit = -1;
+    if (!m->cur.ok || !m->prev.ok || dt <= 0)
+        return;
+
+    m->ops = (m->cur.reads + m->cur.writes - m->prev.reads - m->prev.writes) / dt;
+    m->reqs = (m->cur.requests - m->prev.requests) / dt;
+    m->errs = (m->cur.errors + m->cur.request_errors - m->prev.errors - m->prev.request_errors) / dt;
+    m->rejs = (m->cur.rejected - m->prev.rejected) / dt;
+    m->retries = (m->cur.retries - m->prev.retries) / dt;
+
+    hits = m->cur.hits - m->prev.hits;
+    misses = m->cur.misses - m->prev.misses;
+    if (hits + misses)
+        m->hit = 100.0 * hits / (hits + misses);
+
+    for (i = 0; i < RTT_BUCKETS; i++) {
+        h[i] = m->cur.rtt[i] - m->prev.rtt[i];
+        total += h[i];
+    }
+    if (total) {
+        m->p50 = _percentile(h, total, 0.5);
+        m->p99 = _percentile(h, total, 0.99);
+        for (i = RTT_BUCKETS - 1; !h[i]; i--)
+            ;
+        m->max = 2L << i;
+    }
+}
+
+static int _worst_first(const void * a, const void * b)
+{
+    const struct mount * x = a, * y = b;
+    if (x->cur.ok != y->cur.ok)
+        return x->cur.ok ? 1 : -1;
+    if (x->p99 != y->p99)
+        return x->p99 < y->p99 ? 1 : -1;
+    return x->errs < y->errs ? 1 : x->errs > y->errs ? -1 : 0;
+}
+
+static void _ms(long us)
+{
+    if (us < 0)
+        printf(" %8s", "-");
+    else
+        printf(" %8.1f", us / 1000.0);
+}
+
+static void _show(struct mount * mounts, int n, double interval)
+{
+    int i;
+
+    printf("\033[H\033[J");
+    printf("dkrfs-top  %d mount%s, every %.1fs, round trips as upper bucket bounds\n\n",
+           n, n == 1 ? "" : "s", interval);
+    printf("%-20s %-16s %-7s %8s %8s %8s %7s %7s %6s %6s %8s %8s %8s %5s %6s\n",
+           "MOUNT", "DEVICE", "BACKEND", "OPS/s", "REQ/s", "ERR/s", "RETRY/s", "REJ/s", "QUEUE",
+           "HIT%", "P50ms", "P99ms", "MAXms", "INFL", "AGEms");
+    for (i = 0; i < n; i++) {
+        struct mount * m = &mounts[i];
+        if (!m->cur.ok) {
+            printf("%-20.20s (no stats)\n", m->path);
+            continue;
+        }
+        printf("%-20.20s %-16.16s %-7.7s %8.1f %8.1f %8.1f %7.1f %7.1f %6u", m->path, m->cur.device,
+               m->cur.backend, m->ops, m->reqs, m->errs, m->retries, m->rejs, m->cur.queued);
+        if (m->hit < 0)
+            printf(" %6s", "-");
+        else
+            printf(" %6.1f", m->hit);
+        _ms(m->p50);
+        _ms(m->p99);
+        _ms(m->max);
+        printf(" %2u/%-2u %6lld\n", m->cur.inflight, m->cur.inflight_max, m->cur.snapshot_age_ms);
+    }
+    fflush(stdout);
+}
+
+static void usage(const char * progname)
+{
+    printf("Usage: %s [-d seconds] [-n iterations] <mount-point>...\n", progname);
+}
+
+int main(int argc, char * argv[])
+{
+    struct mount * mounts, * sorted;
+    double interval = 1.0;
+    int iterations = -1, n, i, opt;
+
+    while ((opt = getopt(argc, argv, "d:n:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            interval = atof(optarg);
+            if (interval <= 0)
+                interval = 1.0;
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    n = argc - optind;
+    if (!n) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    mounts = calloc(n, sizeof(*mounts));
+    sorted = calloc(n, sizeof(*sorted));
+    for (i = 0; i < n; i++) {
+        mounts[i].path = argv[optind + i];
+        _read_stats(mounts[i].path, &mounts[i].cur);
+    }
+
+    while (iterations < 0 || iterations--) {
+        struct timespec ts = { (time_t)interval, (long)((interval - (time_t)interval) * 1e9) };
+        nanosleep(&ts, NULL);
+        for (i = 0; i < n; i++)
+            _update(&mounts[i], interval);
+        memcpy(sorted, mounts, n * sizeof(*sorted));
+        qsort(sorted, n, sizeof(*sorted), _worst_first);
+        _show(sorted, n, interval);
+    }
+
+    free(mounts);
+    free(sorted);
+    return 0;
+}